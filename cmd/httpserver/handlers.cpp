@@ -1,8 +1,12 @@
 #include "handlers.hpp"
 #include "Request.hpp"
-#include "Sha256.hpp"
-#include <cstdio>
-#include <sstream>
+#include "TrailerDigest.hpp"
+#include "BodySource.hpp"
+#include <csignal>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 static const char BODY_200[] =
     "<html>\n"
@@ -37,57 +41,84 @@ static const char BODY_500[] =
     "  </body>\n"
     "</html>";
 
-static void sendHtml(Response::Writer& w, Response::StatusCode status,
-                     const char* body, size_t bodyLen) {
+static Headers htmlHeaders() {
     Headers h = Response::getDefaultHeaders(0);
-    std::ostringstream oss;
-    oss << bodyLen;
-    h.replace("Content-Length", oss.str());
     h.replace("Content-Type", "text/html");
-    w.writeStatusLine(status);
-    w.writeHeaders(h);
-    w.writeBody(body, bodyLen);
+    return h;
 }
 
-void handleDefault(Response::Writer& w, const Request&) {
-    sendHtml(w, Response::StatusOk, BODY_200, sizeof(BODY_200) - 1);
+const Response::Prepared PAGE_200(Response::StatusOk, htmlHeaders(),
+                                  BODY_200, sizeof(BODY_200) - 1);
+const Response::Prepared PAGE_400(Response::StatusBadRequest, htmlHeaders(),
+                                  BODY_400, sizeof(BODY_400) - 1);
+const Response::Prepared PAGE_500(Response::StatusInternalServerError, htmlHeaders(),
+                                  BODY_500, sizeof(BODY_500) - 1);
+
+// The file comes from the handler's cache of open fds, with its validators,
+// so conditional and If-Range requests are answered without opening it.
+// The file, or the ranges asked for, go out with sendfile from the event
+// loop. A precompressed sidecar ("vim.mp4.gz") is sent instead if the
+// client prefers it.
+void VideoHandler::handle(Response::Writer& w, const Request& req) {
+    files.serve(w, req, name);
 }
 
-void handle400(Response::Writer& w, const Request&) {
-    sendHtml(w, Response::StatusBadRequest, BODY_400, sizeof(BODY_400) - 1);
-}
+// Upstream output arrives in small reads; send it in larger chunks
+static const size_t HTTPBIN_CHUNK_SIZE = 4096;
+static const long HTTPBIN_CHUNK_DELAY_MS = 100;
 
-void handle500(Response::Writer& w, const Request&) {
-    sendHtml(w, Response::StatusInternalServerError, BODY_500, sizeof(BODY_500) - 1);
-}
+// curl processes killed before they had exited. They are reaped on later
+// requests, so the event loop never waits for one.
+static std::vector<pid_t> dyingChildren;
 
-void VideoHandler::handle(Response::Writer& w, const Request&) {
-    FILE* f = std::fopen(path.c_str(), "rb");
-    if (f == NULL) {
-        sendHtml(w, Response::StatusInternalServerError, BODY_500, sizeof(BODY_500) - 1);
-        return;
+static void reapChildren() {
+    for (size_t i = 0; i < dyingChildren.size();) {
+        if (waitpid(dyingChildren[i], NULL, WNOHANG) != 0) {
+            dyingChildren.erase(dyingChildren.begin() + i);
+        } else {
+            i++;
+        }
     }
+}
 
-    Headers h = Response::getDefaultHeaders(0);
-    h.remove("content-length");
-    h.set("transfer-encoding", "chunked");
-    h.replace("content-type", "video/mp4");
-    w.writeStatusLine(Response::StatusOk);
-    w.writeHeaders(h);
+// Runs curl on url with its output on a pipe. Returns the read end, or -1.
+static int spawnCurl(const std::string& url, pid_t& pid) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        execlp("curl", "curl", "-s", url.c_str(), static_cast<char*>(NULL));
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    return fds[0];
+}
 
-    char buf[1024];
-    for (;;) {
-        size_t n = std::fread(buf, 1, sizeof(buf), f);
-        if (n > 0) {
-            w.writeChunkedBody(buf, n);
-        }
-        if (n < sizeof(buf)) {
-            break;
+// Streams curl's output from the event loop. The digests live here
+// because the trailers are computed after the handler has returned. A
+// response cut short, e.g. by the client going away, kills curl rather
+// than waiting for the download to finish.
+struct UpstreamSource : public Response::FdSource {
+    pid_t pid;
+    Response::Sha256Digest sha;
+    Response::LengthDigest length;
+
+    UpstreamSource(int fd, pid_t p) : Response::FdSource(fd, true), pid(p) {}
+    ~UpstreamSource() {
+        if (waitpid(pid, NULL, WNOHANG) == 0) {
+            kill(pid, SIGKILL);
+            dyingChildren.push_back(pid);
         }
+        reapChildren();
     }
-    w.writeChunkedBodyDone();
-    std::fclose(f);
-}
+};
 
 static bool isSafePath(const std::string& path) {
     for (size_t i = 0; i < path.size(); ++i) {
@@ -102,51 +133,32 @@ static bool isSafePath(const std::string& path) {
 }
 
 void handleHttpbin(Response::Writer& w, const Request& req) {
-    std::string target = req.getTarget();
-    std::string httpbinPath = target.substr(9); // after "/httpbin/"
+    std::string httpbinPath = req.param("*").str();
 
     if (!isSafePath(httpbinPath)) {
-        sendHtml(w, Response::StatusInternalServerError, BODY_500, sizeof(BODY_500) - 1);
+        w.writePrepared(PAGE_500);
         return;
     }
 
-    std::string cmd = "curl -s https://httpbin.org/" + httpbinPath;
-    FILE* pipe = popen(cmd.c_str(), "r");
-    if (pipe == NULL) {
-        sendHtml(w, Response::StatusInternalServerError, BODY_500, sizeof(BODY_500) - 1);
+    reapChildren();
+    pid_t pid;
+    int fd = spawnCurl("https://httpbin.org/" + httpbinPath, pid);
+    if (fd < 0) {
+        w.writePrepared(PAGE_500);
         return;
     }
 
+    UpstreamSource* upstream = new UpstreamSource(fd, pid);
+    w.addTrailer("X-Content-SHA256", upstream->sha);
+    w.addTrailer("X-Content-Length", upstream->length);
+    w.setEncoding(Response::negotiateEncoding(req.getHeaders().get("accept-encoding")));
+
     Headers h = Response::getDefaultHeaders(0);
     h.remove("content-length");
     h.set("transfer-encoding", "chunked");
     h.replace("content-type", "text/plain");
-    h.set("Trailer", "X-Content-SHA256");
-    h.set("Trailer", "X-Content-Length");
     w.writeStatusLine(Response::StatusOk);
     w.writeHeaders(h);
-
-    std::string fullBody;
-    char data[32];
-    for (;;) {
-        size_t n = fread(data, 1, sizeof(data), pipe);
-        if (n == 0) {
-            break;
-        }
-        fullBody.append(data, n);
-        w.writeChunkedBody(data, n);
-    }
-    pclose(pipe);
-
-    w.writeBody("0\r\n", 3);
-
-    unsigned char hash[32];
-    Crypto::sha256(fullBody, hash);
-    Headers trailers;
-    trailers.set("X-Content-SHA256", Crypto::toHexStr(hash, 32));
-    std::ostringstream toss;
-    toss << fullBody.size();
-    trailers.set("X-Content-Length", toss.str());
-    w.writeHeaders(trailers);
-    w.writeBody("\r\n\r\n", 4);
+    w.setChunking(HTTPBIN_CHUNK_SIZE, HTTPBIN_CHUNK_DELAY_MS);
+    w.stream(upstream);
 }
@@ -3,17 +3,20 @@
 
 #include "Response.hpp"
 #include "Router.hpp"
+#include "StaticFileHandler.hpp"
 #include <string>
 
 class Request;
 
-void handleDefault(Response::Writer& w, const Request& req);
-void handle400(Response::Writer& w, const Request& req);
-void handle500(Response::Writer& w, const Request& req);
+extern const Response::Prepared PAGE_200;
+extern const Response::Prepared PAGE_400;
+extern const Response::Prepared PAGE_500;
 
+// Serves one file of a StaticFileHandler, e.g. "/video" as "vim.mp4"
 struct VideoHandler : public RouteHandler {
-    std::string path;
-    VideoHandler(const std::string& p) : path(p) {}
+    StaticFileHandler& files;
+    std::string name;
+    VideoHandler(StaticFileHandler& f, const std::string& n) : files(f), name(n) {}
     void handle(Response::Writer& w, const Request& req);
 };
 
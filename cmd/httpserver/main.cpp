@@ -1,30 +1,109 @@
 #include <iostream>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <pthread.h>
 #include "Router.hpp"
+#include "RouteTable.hpp"
 #include "Server.hpp"
+#include "StaticFileHandler.hpp"
 #include "handlers.hpp"
 
 #define PORT 42069
 
+// A little above the video's bitrate, so viewers don't saturate the link
+#define VIDEO_BYTES_PER_SEC (1024 * 1024)
+#define VIDEO_BURST_BYTES (256 * 1024)
+
+static Router* buildRoutes(VideoHandler& videoHandler, StaticFileHandler& assets) {
+    Router* router = new Router;
+    router->get("/yourproblem", PAGE_400);
+    router->get("/myproblem", PAGE_500);
+    router->get("/video", videoHandler);
+    router->limit("/video", VIDEO_BYTES_PER_SEC, VIDEO_BURST_BYTES);
+    router->get("/assets/*", assets);
+    router->prefix("/httpbin/", handleHttpbin);
+    router->setDefault(PAGE_200);
+    router->freeze();
+    return router;
+}
+
+// Rebuilds and republishes the routes on SIGHUP while the server runs.
+// Once a second it also frees routers the loop can no longer see.
+struct Reloader {
+    RouteTable* routes;
+    VideoHandler* video;
+    StaticFileHandler* assets;
+    volatile int stopping;
+};
+
+static void* reloadRoutes(void* arg) {
+    Reloader* r = static_cast<Reloader*>(arg);
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    struct timespec second = {1, 0};
+    while (!r->stopping) {
+        int sig = sigtimedwait(&hup, NULL, &second);
+        if (r->stopping) {
+            break;
+        }
+        if (sig == SIGHUP) {
+            Router* router = buildRoutes(*r->video, *r->assets);
+            if (r->routes->publish(router)) {
+                std::cout << "Routes reloaded" << std::endl;
+            } else {
+                delete router;
+                std::cerr << "Routes could not be reloaded" << std::endl;
+            }
+        } else if (sig < 0 && errno == EAGAIN && r->routes->retiredCount() > 0) {
+            r->routes->reclaim();
+        }
+    }
+    return NULL;
+}
+
 int main() {
-    Router router;
-    router.get("/yourproblem", handle400);
-    router.get("/myproblem", handle500);
-    VideoHandler videoHandler("assets/vim.mp4");
-    router.get("/video", videoHandler);
-    router.prefix("/httpbin/", handleHttpbin);
-    router.setDefault(handleDefault);
+    // Only the reloader takes SIGHUP and only the server's signalfd
+    // SIGINT and SIGTERM; every thread inherits the mask
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    StaticFileHandler assets("assets");
+    VideoHandler videoHandler(assets, "vim.mp4");
+    // Routes can be republished while serving; the table owns them
+    RouteTable routes;
+    routes.publish(buildRoutes(videoHandler, assets));
 
     std::string errorMsg;
-    Server* s = Server::serve(PORT, router, errorMsg);
+    Server* s = Server::serve(PORT, routes, errorMsg);
     if (s == NULL) {
         std::cerr << "Error starting server: " << errorMsg << std::endl;
         return 1;
     }
 
+    Reloader reloader;
+    reloader.routes = &routes;
+    reloader.video = &videoHandler;
+    reloader.assets = &assets;
+    reloader.stopping = 0;
+    pthread_t reloadThread;
+    bool reloading = pthread_create(&reloadThread, NULL, reloadRoutes, &reloader) == 0;
+
     std::cout << "Server started on port " << PORT << std::endl;
 
     s->run();
 
+    if (reloading) {
+        reloader.stopping = 1;
+        pthread_kill(reloadThread, SIGHUP);
+        pthread_join(reloadThread, NULL);
+    }
+
     s->close();
     delete s;
 
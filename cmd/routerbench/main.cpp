@@ -0,0 +1,82 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <ctime>
+#include "Router.hpp"
+
+// Measures Router::find against route tables of growing size, shaped like
+// a gateway config: exact resource routes plus a prefix per service.
+// Each size runs on the tree alone and again after freeze().
+
+#define LOOKUPS 1000000
+
+struct NopHandler : public RouteHandler {
+    void handle(Response::Writer&, const Request&) {}
+};
+
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static std::string routePath(size_t i) {
+    std::ostringstream oss;
+    oss << "/api/v" << (i % 3 + 1) << "/service" << i / 10 << "/resource" << i;
+    return oss.str();
+}
+
+// Mean ns per find() over targets
+static double timeLookups(const Router& router, const std::vector<std::string>& targets, size_t& found) {
+    found = 0;
+    double start = nowSeconds();
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        if (router.find("GET", targets[i % targets.size()]) != NULL) {
+            found++;
+        }
+    }
+    return (nowSeconds() - start) * 1e9 / LOOKUPS;
+}
+
+static void bench(size_t routes, bool frozen) {
+    NopHandler handler;
+    Router router;
+    for (size_t i = 0; i < routes; i++) {
+        router.get(routePath(i), handler);
+        if (i % 10 == 0) {
+            std::ostringstream oss;
+            oss << "/api/v" << (i % 3 + 1) << "/service" << i / 10 << "/";
+            router.prefix(oss.str(), handler);
+        }
+    }
+    if (frozen) {
+        router.freeze();
+    }
+    // Hits on exact routes, hits on prefixes and misses, timed apart:
+    // freeze() only shortcuts the first
+    std::vector<std::string> exact, prefix, miss;
+    for (size_t i = 0; i < 64; i++) {
+        size_t r = (i * 7919) % routes;
+        exact.push_back(routePath(r));
+        prefix.push_back(routePath(r) + "/items/42?page=2");
+        miss.push_back("/static/" + routePath(r));
+    }
+
+    size_t hits, prefixHits, missHits;
+    double exactNs = timeLookups(router, exact, hits);
+    double prefixNs = timeLookups(router, prefix, prefixHits);
+    double missNs = timeLookups(router, miss, missHits);
+    std::cout << routes << " routes" << (frozen ? ", frozen" : "") << ": exact " << exactNs
+              << " ns, prefix " << prefixNs << " ns, miss " << missNs << " ns per lookup ("
+              << hits + prefixHits + missHits << " hits)" << std::endl;
+}
+
+int main() {
+    size_t sizes[] = {10, 100, 1000, 10000};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench(sizes[i], false);
+        bench(sizes[i], true);
+    }
+    return 0;
+}
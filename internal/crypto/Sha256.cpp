@@ -4,7 +4,7 @@ static unsigned int rotr(unsigned int x, int n) {
     return (x >> n) | (x << (32 - n));
 }
 
-void Crypto::sha256(const unsigned char* data, size_t len, unsigned char hash[32]) {
+static void compress(unsigned int h[8], const unsigned char* block) {
     static const unsigned int k[64] = {
         0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
         0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
@@ -24,69 +24,97 @@ void Crypto::sha256(const unsigned char* data, size_t len, unsigned char hash[32
         0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
     };
 
-    size_t padded_len = len + 1;
-    while (padded_len % 64 != 56) padded_len++;
-    padded_len += 8;
+    unsigned int w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((unsigned int)block[i*4] << 24)
+             | ((unsigned int)block[i*4+1] << 16)
+             | ((unsigned int)block[i*4+2] << 8)
+             | ((unsigned int)block[i*4+3]);
+    }
+    for (int i = 16; i < 64; i++) {
+        unsigned int s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+        unsigned int s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    unsigned int a = h[0], b = h[1], c = h[2], d = h[3];
+    unsigned int e = h[4], f = h[5], g = h[6], hh = h[7];
 
-    unsigned char* msg = new unsigned char[padded_len];
-    for (size_t i = 0; i < padded_len; i++) msg[i] = 0;
-    for (size_t i = 0; i < len; i++) msg[i] = data[i];
-    msg[len] = 0x80;
+    for (int i = 0; i < 64; i++) {
+        unsigned int S1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        unsigned int ch = (e & f) ^ ((~e) & g);
+        unsigned int temp1 = hh + S1 + ch + k[i] + w[i];
+        unsigned int S0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        unsigned int maj = (a & b) ^ (a & c) ^ (b & c);
+        unsigned int temp2 = S0 + maj;
 
-    unsigned long long bit_len = (unsigned long long)len * 8;
-    for (int i = 0; i < 8; i++) {
-        msg[padded_len - 1 - i] = (unsigned char)(bit_len >> (i * 8));
+        hh = g; g = f; f = e; e = d + temp1;
+        d = c; c = b; b = a; a = temp1 + temp2;
     }
 
-    unsigned int h0 = 0x6a09e667, h1 = 0xbb67ae85;
-    unsigned int h2 = 0x3c6ef372, h3 = 0xa54ff53a;
-    unsigned int h4 = 0x510e527f, h5 = 0x9b05688c;
-    unsigned int h6 = 0x1f83d9ab, h7 = 0x5be0cd19;
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
 
-    for (size_t offset = 0; offset < padded_len; offset += 64) {
-        unsigned int w[64];
-        for (int i = 0; i < 16; i++) {
-            w[i] = ((unsigned int)msg[offset + i*4] << 24)
-                 | ((unsigned int)msg[offset + i*4+1] << 16)
-                 | ((unsigned int)msg[offset + i*4+2] << 8)
-                 | ((unsigned int)msg[offset + i*4+3]);
+Crypto::Sha256::Sha256() : blockLen(0), totalLen(0) {
+    h[0] = 0x6a09e667; h[1] = 0xbb67ae85;
+    h[2] = 0x3c6ef372; h[3] = 0xa54ff53a;
+    h[4] = 0x510e527f; h[5] = 0x9b05688c;
+    h[6] = 0x1f83d9ab; h[7] = 0x5be0cd19;
+}
+
+void Crypto::Sha256::update(const unsigned char* data, size_t len) {
+    totalLen += len;
+    if (blockLen > 0) {
+        while (len > 0 && blockLen < 64) {
+            block[blockLen++] = *data++;
+            len--;
         }
-        for (int i = 16; i < 64; i++) {
-            unsigned int s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
-            unsigned int s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
-            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        if (blockLen < 64) {
+            return;
         }
+        compress(h, block);
+        blockLen = 0;
+    }
+    while (len >= 64) {
+        compress(h, data);
+        data += 64;
+        len -= 64;
+    }
+    for (size_t i = 0; i < len; i++) {
+        block[blockLen++] = data[i];
+    }
+}
 
-        unsigned int a = h0, b = h1, c = h2, d = h3;
-        unsigned int e = h4, f = h5, g = h6, hh = h7;
-
-        for (int i = 0; i < 64; i++) {
-            unsigned int S1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
-            unsigned int ch = (e & f) ^ ((~e) & g);
-            unsigned int temp1 = hh + S1 + ch + k[i] + w[i];
-            unsigned int S0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
-            unsigned int maj = (a & b) ^ (a & c) ^ (b & c);
-            unsigned int temp2 = S0 + maj;
-
-            hh = g; g = f; f = e; e = d + temp1;
-            d = c; c = b; b = a; a = temp1 + temp2;
-        }
+void Crypto::Sha256::final(unsigned char hash[32]) {
+    unsigned long long bit_len = totalLen * 8;
 
-        h0 += a; h1 += b; h2 += c; h3 += d;
-        h4 += e; h5 += f; h6 += g; h7 += hh;
+    block[blockLen++] = 0x80;
+    if (blockLen > 56) {
+        while (blockLen < 64) block[blockLen++] = 0;
+        compress(h, block);
+        blockLen = 0;
     }
+    while (blockLen < 56) block[blockLen++] = 0;
+    for (int i = 0; i < 8; i++) {
+        block[63 - i] = (unsigned char)(bit_len >> (i * 8));
+    }
+    compress(h, block);
 
-    delete[] msg;
-
-    unsigned int hvals[8] = {h0, h1, h2, h3, h4, h5, h6, h7};
     for (int i = 0; i < 8; i++) {
-        hash[i*4]   = (unsigned char)(hvals[i] >> 24);
-        hash[i*4+1] = (unsigned char)(hvals[i] >> 16);
-        hash[i*4+2] = (unsigned char)(hvals[i] >> 8);
-        hash[i*4+3] = (unsigned char)(hvals[i]);
+        hash[i*4]   = (unsigned char)(h[i] >> 24);
+        hash[i*4+1] = (unsigned char)(h[i] >> 16);
+        hash[i*4+2] = (unsigned char)(h[i] >> 8);
+        hash[i*4+3] = (unsigned char)(h[i]);
     }
 }
 
+void Crypto::sha256(const unsigned char* data, size_t len, unsigned char hash[32]) {
+    Sha256 ctx;
+    ctx.update(data, len);
+    ctx.final(hash);
+}
+
 void Crypto::sha256(const std::string& input, unsigned char hash[32]) {
     sha256(reinterpret_cast<const unsigned char*>(input.data()), input.size(), hash);
 }
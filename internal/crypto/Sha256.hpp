@@ -6,6 +6,21 @@
 
 namespace Crypto {
 
+// Incremental SHA-256 for data that arrives in pieces
+class Sha256 {
+public:
+    Sha256();
+
+    void update(const unsigned char* data, size_t len);
+    void final(unsigned char hash[32]);
+
+private:
+    unsigned int h[8];
+    unsigned char block[64];
+    size_t blockLen;
+    unsigned long long totalLen;
+};
+
 void sha256(const unsigned char* data, size_t len, unsigned char hash[32]);
 void sha256(const std::string& input, unsigned char hash[32]);
 
@@ -0,0 +1,90 @@
+#include "Query.hpp"
+#include "Util.hpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace Query {
+
+    bool needsDecoding(const StringView& s) {
+        const char* p = s.data();
+        size_t n = s.size();
+        size_t i = 0;
+#ifdef __SSE2__
+        // Sixteen bytes per compare; most query values have no escapes
+        const __m128i pct = _mm_set1_epi8('%');
+        const __m128i plus = _mm_set1_epi8('+');
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, plus));
+            if (_mm_movemask_epi8(hit) != 0) {
+                return true;
+            }
+        }
+#endif
+        for (; i < n; i++) {
+            if (p[i] == '%' || p[i] == '+') {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool decode(const StringView& raw, char* buf, size_t cap, StringView& out) {
+        if (!needsDecoding(raw)) {
+            out = raw;
+            return true;
+        }
+        const char* p = raw.data();
+        size_t n = raw.size();
+        size_t len = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (len == cap) {
+                return false;
+            }
+            char c = p[i];
+            if (c == '+') {
+                c = ' ';
+            } else if (c == '%' && i + 2 < n) {
+                int hi = hexValue(p[i + 1]);
+                int lo = hexValue(p[i + 2]);
+                if (hi >= 0 && lo >= 0) {
+                    c = static_cast<char>(hi * 16 + lo);
+                    i += 2;
+                }
+            }
+            buf[len++] = c;
+        }
+        out = StringView(buf, len);
+        return true;
+    }
+
+    Iterator::Iterator(const StringView& query)
+        : pos(query.data()), end(query.data() + query.size()) {}
+
+    bool Iterator::next(StringView& key, StringView& value) {
+        while (pos < end) {
+            const char* start = pos;
+            while (pos < end && *pos != '&') {
+                pos++;
+            }
+            const char* stop = pos;
+            if (pos < end) {
+                pos++;
+            }
+            if (stop == start) {
+                continue;
+            }
+            const char* eq = start;
+            while (eq < stop && *eq != '=') {
+                eq++;
+            }
+            key = StringView(start, static_cast<size_t>(eq - start));
+            value = eq < stop ? StringView(eq + 1, static_cast<size_t>(stop - eq - 1)) : StringView();
+            return true;
+        }
+        return false;
+    }
+
+}
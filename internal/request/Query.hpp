@@ -0,0 +1,35 @@
+#ifndef QUERY_HPP
+#define QUERY_HPP
+
+#include <cstddef>
+#include "StringView.hpp"
+
+// application/x-www-form-urlencoded query strings, read in place. Keys
+// and values come back as raw views into the target; decode() turns one
+// into text only when it holds escapes.
+namespace Query {
+
+    // True if s has a '%' escape or a '+' to decode
+    bool needsDecoding(const StringView& s);
+
+    // Decodes "%XX" and '+' in raw. If nothing needs decoding, out is raw
+    // itself; otherwise the text is written to buf and out views it.
+    // Decoded text is never longer than raw. False if it does not fit in
+    // cap bytes. Malformed escapes are kept as they are.
+    bool decode(const StringView& raw, char* buf, size_t cap, StringView& out);
+
+    // Walks "a=1&b=2" one pair at a time without copying. A key without
+    // '=' has an empty value; empty pairs are skipped.
+    class Iterator {
+    public:
+        explicit Iterator(const StringView& query);
+        bool next(StringView& key, StringView& value);
+
+    private:
+        const char* pos;
+        const char* end;
+    };
+
+}
+
+#endif
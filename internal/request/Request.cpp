@@ -7,16 +7,92 @@ const char* const Request::ERROR_MALFORMED_REQUEST_LINE = "malformed request-lin
 const char* const Request::ERROR_REQUEST_IN_ERROR_STATE = "request in error state";
 const char* const Request::SEPARATOR = "\r\n";
 
-Request::Request() : state(ParserState::Init), chunkedRemaining(0) {}
+static const char* const METHOD_NAMES[HttpMethod::COUNT] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "PATCH", "OPTIONS"
+};
+
+HttpMethod::Method HttpMethod::parse(const std::string& name) {
+    for (int i = 0; i < COUNT; i++) {
+        if (name == METHOD_NAMES[i]) {
+            return static_cast<Method>(i);
+        }
+    }
+    return Other;
+}
+
+const char* HttpMethod::name(Method m) {
+    return m < COUNT ? METHOD_NAMES[m] : NULL;
+}
+
+const size_t Request::MAX_PARAMS;
+
+Request::Request() : state(ParserState::Init), chunkedRemaining(0), numParams(0) {
+    requestLine.methodId = HttpMethod::Other;
+    requestLine.pathLength = 0;
+}
 
 const std::string& Request::getMethod() const {
     return requestLine.method;
 }
 
+HttpMethod::Method Request::getMethodId() const {
+    return requestLine.methodId;
+}
+
 const std::string& Request::getTarget() const {
     return requestLine.requestTarget;
 }
 
+std::string Request::normalizeHost(const std::string& h) {
+    size_t end = h.size();
+    // A port follows the last ':', except inside an IPv6 literal
+    size_t colon = h.rfind(':');
+    if (colon != std::string::npos && h.find(']', colon) == std::string::npos) {
+        end = colon;
+    }
+    if (end > 0 && h[end - 1] == '.') {
+        end--;
+    }
+    std::string out(h, 0, end);
+    for (size_t i = 0; i < out.size(); i++) {
+        if (out[i] >= 'A' && out[i] <= 'Z') {
+            out[i] = static_cast<char>(out[i] - 'A' + 'a');
+        }
+    }
+    return out;
+}
+
+StringView Request::getPath() const {
+    return StringView(requestLine.requestTarget.data(), requestLine.pathLength);
+}
+
+StringView Request::getQuery() const {
+    const std::string& t = requestLine.requestTarget;
+    if (requestLine.pathLength >= t.size()) {
+        return StringView();
+    }
+    return StringView(t.data() + requestLine.pathLength + 1, t.size() - requestLine.pathLength - 1);
+}
+
+// Longest escaped name compared by decoding; longer ones never match
+static const size_t MAX_QUERY_NAME = 256;
+
+bool Request::queryParam(const char* name, StringView& value) const {
+    StringView want(name, std::strlen(name));
+    Query::Iterator it = queryParams();
+    StringView key;
+    StringView raw;
+    char buf[MAX_QUERY_NAME];
+    while (it.next(key, raw)) {
+        StringView decoded;
+        if (Query::decode(key, buf, sizeof(buf), decoded) && decoded == want) {
+            value = raw;
+            return true;
+        }
+    }
+    return false;
+}
+
 const std::string& Request::getHttpVersion() const {
     return requestLine.httpVersion;
 }
@@ -29,6 +105,22 @@ const std::string& Request::getBody() const {
     return body;
 }
 
+StringView Request::param(const char* name) const {
+    for (size_t i = 0; i < numParams; i++) {
+        if (std::strcmp(params[i].name, name) == 0) {
+            return params[i].value;
+        }
+    }
+    return StringView();
+}
+
+void Request::setParams(const PathParam* p, size_t n) const {
+    numParams = n < MAX_PARAMS ? n : MAX_PARAMS;
+    for (size_t i = 0; i < numParams; i++) {
+        params[i] = p[i];
+    }
+}
+
 bool Request::hasBody() const {
     std::string lengthStr = headers.get("content-length");
     if (lengthStr.empty()) {
@@ -81,7 +173,12 @@ int Request::parseRequestLine(const std::string& buffer,
     }
 
     rl.method = startLine.substr(0, firstSpace);
+    rl.methodId = HttpMethod::parse(rl.method);
     rl.requestTarget = startLine.substr(firstSpace + 1, secondSpace - firstSpace - 1);
+    rl.pathLength = rl.requestTarget.find('?');
+    if (rl.pathLength == std::string::npos) {
+        rl.pathLength = rl.requestTarget.size();
+    }
     std::string httpVersionFull = startLine.substr(secondSpace + 1);
 
     // Validate HTTP version format: HTTP/1.1
@@ -139,6 +236,7 @@ int Request::parse(const std::string& data, std::string& errorMsg) {
                 }
                 totalRead += result.bytesConsumed;
                 if (result.done) {
+                    host = normalizeHost(headers.get("host"));
                     if (isChunkedEncoding()) {
                         state = ParserState::ChunkedSize;
                     } else if (hasBody()) {
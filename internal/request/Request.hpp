@@ -3,6 +3,8 @@
 
 #include <string>
 #include "Headers.hpp"
+#include "StringView.hpp"
+#include "Query.hpp"
 
 namespace ParserState {
     enum State {
@@ -18,24 +20,80 @@ namespace ParserState {
     };
 }
 
+namespace HttpMethod {
+    enum Method {
+        Get,
+        Head,
+        Post,
+        Put,
+        Delete,
+        Patch,
+        Options,
+        Other // any other token; compare getMethod() for these
+    };
+
+    // Methods with an enum value of their own
+    const int COUNT = Other;
+
+    Method parse(const std::string& name);
+    // NULL for Other
+    const char* name(Method m);
+}
+
 struct RequestLine {
+    HttpMethod::Method methodId;
     std::string method;
     std::string requestTarget;
+    size_t pathLength; // of the target before any '?'
     std::string httpVersion;
 };
 
+// A value captured from the target by a route pattern. The name points
+// into the router and the value into the request target.
+struct PathParam {
+    const char* name;
+    StringView value;
+};
+
 class Request {
 public:
+    // Most captures a route may bind
+    static const size_t MAX_PARAMS = 8;
+
     Request();
 
     const std::string& getMethod() const;
+    // The method as parsed once with the request line
+    HttpMethod::Method getMethodId() const;
     const std::string& getTarget() const;
+    // The target split once at the first '?'; the query excludes it
+    StringView getPath() const;
+    StringView getQuery() const;
+    Query::Iterator queryParams() const { return Query::Iterator(getQuery()); }
+    // The raw value of the first query parameter named name, matching
+    // escaped names after decoding. False if there is none.
+    bool queryParam(const char* name, StringView& value) const;
     const std::string& getHttpVersion() const;
+    // The Host header, normalized once when the headers are parsed
+    const std::string& getHost() const { return host; }
     const ::Headers& getHeaders() const;
     const std::string& getBody() const;
     template <typename Func>
     void forEachHeader(Func func) const { headers.forEach(func); }
 
+    // Captures bound by the router: ":name" segments by name and the rest
+    // of the path below a wildcard or prefix route as "*". An empty view
+    // if there is no such capture.
+    StringView param(const char* name) const;
+    size_t paramCount() const { return numParams; }
+    const PathParam& paramAt(size_t i) const { return params[i]; }
+    // Called by the router once it has matched the request
+    void setParams(const PathParam* p, size_t n) const;
+
+    // Lowercases a host and drops any port and trailing dot, so
+    // "Example.COM.:8080" becomes "example.com"
+    static std::string normalizeHost(const std::string& host);
+
     static const char* const ERROR_MALFORMED_REQUEST_LINE;
     static const char* const ERROR_REQUEST_IN_ERROR_STATE;
 
@@ -47,8 +105,12 @@ private:
     RequestLine requestLine;
     ::Headers headers;
     std::string body;
+    std::string host;
     ParserState::State state;
     int chunkedRemaining;
+    // Routing result, not part of the parsed message
+    mutable PathParam params[MAX_PARAMS];
+    mutable size_t numParams;
 
     static const char* const SEPARATOR;
 
@@ -0,0 +1,33 @@
+#ifndef STRINGVIEW_HPP
+#define STRINGVIEW_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+// A borrowed range of characters, e.g. part of a request target. It does
+// not own its data and is only valid while the underlying string lives.
+class StringView {
+public:
+    StringView() : ptr(NULL), len(0) {}
+    StringView(const char* data, size_t size) : ptr(data), len(size) {}
+    StringView(const std::string& s) : ptr(s.data()), len(s.size()) {}
+
+    const char* data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    std::string str() const { return std::string(ptr, len); }
+
+    bool operator==(const StringView& other) const {
+        return len == other.len && (len == 0 || std::memcmp(ptr, other.ptr, len) == 0);
+    }
+    bool operator!=(const StringView& other) const { return !(*this == other); }
+    bool operator==(const char* s) const { return *this == StringView(s, std::strlen(s)); }
+    bool operator!=(const char* s) const { return !(*this == s); }
+
+private:
+    const char* ptr;
+    size_t len;
+};
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef UTIL_HPP
+#define UTIL_HPP
+
+#include <ctime>
+#include <string>
+#include <sys/socket.h>
+
+// Small helpers shared by the request, response and server modules
+
+// Strips spaces and tabs, HTTP's optional whitespace, from both ends
+inline std::string trim(const std::string& s) {
+    size_t b = s.find_first_not_of(" \t");
+    if (b == std::string::npos) {
+        return "";
+    }
+    return s.substr(b, s.find_last_not_of(" \t") - b + 1);
+}
+
+// The value of a hex digit, or -1
+inline int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// True if a socket has a pending error, or cannot be asked
+inline bool socketFailed(int fd) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+        return true;
+    }
+    return err != 0;
+}
+
+// Milliseconds on the monotonic clock, for deadlines and timeouts
+inline long monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#endif
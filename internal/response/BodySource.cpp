@@ -0,0 +1,37 @@
+#include "BodySource.hpp"
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+Response::FdSource::FdSource(int fd, bool owned) : fd(fd), owned(owned) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0) {
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+}
+
+Response::FdSource::~FdSource() {
+    if (owned) {
+        ::close(fd);
+    }
+}
+
+Response::BodySource::Result Response::FdSource::read(char* buf, size_t len, size_t& n) {
+    for (;;) {
+        ssize_t r = ::read(fd, buf, len);
+        if (r > 0) {
+            n = static_cast<size_t>(r);
+            return Ready;
+        }
+        if (r == 0) {
+            return Finished;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return Pending;
+        }
+        return Failed;
+    }
+}
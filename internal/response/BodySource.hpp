@@ -0,0 +1,46 @@
+#ifndef BODYSOURCE_HPP
+#define BODYSOURCE_HPP
+
+#include <cstddef>
+
+namespace Response {
+
+    // Produces a response body piece by piece. A handler hands one to
+    // Writer::stream and returns; the event loop pulls from it whenever
+    // the connection can take more data, so large or slow bodies share
+    // the loop with other connections. A source must not refer to the
+    // Request, which is gone by the time it is read.
+    class BodySource {
+    public:
+        enum Result {
+            Ready,    // n bytes were produced
+            Pending,  // nothing available yet; wait for waitFd() to be readable
+            Finished, // end of body
+            Failed
+        };
+
+        virtual Result read(char* buf, size_t len, size_t& n) = 0;
+        // Readable fd that signals more data after Pending, or -1 if the
+        // source never returns Pending
+        virtual int waitFd() const { return -1; }
+        virtual ~BodySource() {}
+    };
+
+    // Reads the body from an fd such as a pipe or a regular file. The fd
+    // is switched to non-blocking mode and closed on destruction if owned.
+    class FdSource : public BodySource {
+    public:
+        FdSource(int fd, bool owned = false);
+        ~FdSource();
+
+        Result read(char* buf, size_t len, size_t& n);
+        int waitFd() const { return fd; }
+
+    private:
+        int fd;
+        bool owned;
+    };
+
+}
+
+#endif
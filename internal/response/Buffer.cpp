@@ -0,0 +1,405 @@
+#include "Buffer.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+static const size_t SLAB_SIZE = 4096;
+// Copies larger than this get a block of their own
+static const size_t SLAB_MAX_COPY = SLAB_SIZE / 2;
+static const int MAX_IOV = 64;
+static const size_t FALLBACK_READ = 64 * 1024;
+
+Response::Block* Response::Block::alloc(size_t cap) {
+    Block* b = new Block;
+    b->refs = 1;
+    b->bytes = new char[cap];
+    b->cap = cap;
+    b->fd = -1;
+    return b;
+}
+
+Response::Block* Response::Block::file(int fd) {
+    Block* b = new Block;
+    b->refs = 1;
+    b->bytes = NULL;
+    b->cap = 0;
+    b->fd = fd;
+    return b;
+}
+
+void Response::Block::unref() {
+    if (__sync_sub_and_fetch(&refs, 1) == 0) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        delete[] bytes;
+        delete this;
+    }
+}
+
+Response::Buffer::Buffer() : block(NULL), ptr(NULL), len(0) {}
+
+Response::Buffer::Buffer(const char* data, size_t n) : block(NULL), ptr(NULL), len(n) {
+    if (n > 0) {
+        block = Block::alloc(n);
+        std::memcpy(block->bytes, data, n);
+        ptr = block->bytes;
+    }
+}
+
+Response::Buffer::Buffer(const Buffer& other) : block(other.block), ptr(other.ptr), len(other.len) {
+    if (block != NULL) {
+        block->ref();
+    }
+}
+
+Response::Buffer& Response::Buffer::operator=(const Buffer& other) {
+    if (other.block != NULL) {
+        other.block->ref();
+    }
+    if (block != NULL) {
+        block->unref();
+    }
+    block = other.block;
+    ptr = other.ptr;
+    len = other.len;
+    return *this;
+}
+
+Response::Buffer::~Buffer() {
+    if (block != NULL) {
+        block->unref();
+    }
+}
+
+Response::Buffer Response::Buffer::wrap(const char* data, size_t n) {
+    Buffer b;
+    b.ptr = data;
+    b.len = n;
+    return b;
+}
+
+Response::BufferChain::BufferChain()
+    : total(0), files(0), slab(NULL), slabUsed(0), zeroCopyMin(0), nextId(0) {}
+
+Response::BufferChain::~BufferChain() {
+    clear();
+    // Whatever is still in flight goes with the socket
+    for (size_t i = 0; i < inflight.size(); i++) {
+        if (inflight[i].block != NULL) {
+            inflight[i].block->unref();
+        }
+    }
+}
+
+void Response::BufferChain::push(Block* block, const char* data, size_t len, off_t offset) {
+    Slice s;
+    s.block = block;
+    s.data = data;
+    s.len = len;
+    s.offset = offset;
+    slices.push_back(s);
+    total += len;
+    if (block != NULL && block->fd >= 0) {
+        files++;
+    }
+}
+
+void Response::BufferChain::appendCopy(const char* data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (len > SLAB_MAX_COPY) {
+        Block* b = Block::alloc(len);
+        std::memcpy(b->bytes, data, len);
+        push(b, b->bytes, len, 0);
+        return;
+    }
+    if (slab == NULL || slab->cap - slabUsed < len) {
+        if (slab != NULL) {
+            slab->unref();
+        }
+        slab = Block::alloc(SLAB_SIZE);
+        slabUsed = 0;
+    }
+    char* dst = slab->bytes + slabUsed;
+    std::memcpy(dst, data, len);
+    slabUsed += len;
+
+    // Grow the last slice when it ends where this copy starts
+    if (!slices.empty()) {
+        Slice& last = slices.back();
+        if (last.block == slab && last.data + last.len == dst) {
+            last.len += len;
+            total += len;
+            return;
+        }
+    }
+    slab->ref();
+    push(slab, dst, len, 0);
+}
+
+void Response::BufferChain::append(const Buffer& buf, size_t offset, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    Block* b = buf.storage();
+    if (b != NULL) {
+        b->ref();
+    }
+    push(b, buf.data() + offset, len, 0);
+}
+
+bool Response::BufferChain::appendFile(int fd, off_t offset, size_t len) {
+    if (len == 0) {
+        return true;
+    }
+    int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (copy < 0) {
+        return false;
+    }
+    push(Block::file(copy), NULL, len, offset);
+    return true;
+}
+
+int Response::BufferChain::gather(struct iovec* iov, int max) const {
+    if (files > 0 || slices.size() > static_cast<size_t>(max)) {
+        return -1;
+    }
+    int n = 0;
+    for (std::deque<Slice>::const_iterator it = slices.begin(); it != slices.end(); ++it) {
+        iov[n].iov_base = const_cast<char*>(it->data);
+        iov[n].iov_len = it->len;
+        n++;
+    }
+    return n;
+}
+
+void Response::BufferChain::consume(size_t n) {
+    total -= n;
+    while (n > 0) {
+        Slice& s = slices.front();
+        if (n < s.len) {
+            if (s.data != NULL) {
+                s.data += n;
+            }
+            s.offset += static_cast<off_t>(n);
+            s.len -= n;
+            return;
+        }
+        n -= s.len;
+        if (s.block != NULL) {
+            if (s.block->fd >= 0) {
+                files--;
+            }
+            s.block->unref();
+        }
+        slices.pop_front();
+    }
+}
+
+bool Response::BufferChain::zeroCopyable(const Slice& s) const {
+    return zeroCopyMin > 0 && s.len >= zeroCopyMin;
+}
+
+ssize_t Response::BufferChain::writeMemory(int fd, size_t limit) {
+    if (zeroCopyable(slices.front())) {
+        ssize_t sent = writeZeroCopy(fd, limit);
+        if (sent >= 0 || errno != ENOBUFS) {
+            return sent;
+        }
+        // Out of option memory for notifications: copy this one
+    }
+
+    struct iovec iov[MAX_IOV];
+    int n = 0;
+    size_t bytes = 0;
+    bool fileNext = false;
+    for (std::deque<Slice>::const_iterator it = slices.begin();
+         it != slices.end() && n < MAX_IOV && bytes < limit; ++it) {
+        if ((it->block != NULL && it->block->fd >= 0) || (n > 0 && zeroCopyable(*it))) {
+            fileNext = true;
+            break;
+        }
+        size_t take = it->len < limit - bytes ? it->len : limit - bytes;
+        iov[n].iov_base = const_cast<char*>(it->data);
+        iov[n].iov_len = take;
+        bytes += take;
+        n++;
+    }
+
+    if (fileNext) {
+        // Headers ahead of a file range or zero-copy slice share a
+        // segment with its data
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t sent = ::sendmsg(fd, &msg, MSG_MORE | MSG_NOSIGNAL);
+        if (sent >= 0 || errno != ENOTSOCK) {
+            return sent;
+        }
+    }
+    return ::writev(fd, iov, n);
+}
+
+ssize_t Response::BufferChain::writeZeroCopy(int fd, size_t limit) {
+    const Slice& s = slices.front();
+    struct iovec iov;
+    iov.iov_base = const_cast<char*>(s.data);
+    iov.iov_len = s.len < limit ? s.len : limit;
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    ssize_t sent = ::sendmsg(fd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+    if (sent > 0) {
+        // The kernel numbers zero-copy sends in order; the block must
+        // stay alive until the notification for this one arrives
+        Inflight f;
+        f.id = nextId++;
+        f.block = s.block;
+        if (f.block != NULL) {
+            f.block->ref();
+        }
+        inflight.push_back(f);
+    }
+    return sent;
+}
+
+bool Response::BufferChain::enableZeroCopy(int fd, size_t threshold) {
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+        return false;
+    }
+    zeroCopyMin = threshold > 0 ? threshold : 1;
+    return true;
+}
+
+void Response::BufferChain::complete(unsigned int lo, unsigned int hi) {
+    std::deque<Inflight>::iterator it = inflight.begin();
+    while (it != inflight.end()) {
+        // Ranges may wrap around
+        if (it->id - lo <= hi - lo) {
+            if (it->block != NULL) {
+                it->block->unref();
+            }
+            it = inflight.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool Response::BufferChain::reapCompletions(int fd) {
+    while (!inflight.empty()) {
+        char control[128];
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            bool recverr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                           || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            if (!recverr) {
+                continue;
+            }
+            const struct sock_extended_err* err =
+                reinterpret_cast<const struct sock_extended_err*>(CMSG_DATA(cm));
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+                continue;
+            }
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // The kernel copied anyway (e.g. loopback), so stop paying
+                // for notifications on this socket
+                zeroCopyMin = 0;
+            }
+            complete(err->ee_info, err->ee_data);
+        }
+    }
+    return true;
+}
+
+ssize_t Response::BufferChain::writeFile(int fd, size_t limit) {
+    Slice& s = slices.front();
+    size_t want = s.len < limit ? s.len : limit;
+    off_t offset = s.offset;
+    ssize_t n = ::sendfile(fd, s.block->fd, &offset, want);
+    if (n >= 0 || (errno != EINVAL && errno != ENOSYS)) {
+        return n;
+    }
+
+    // sendfile cannot handle this pair: copy through user space
+    size_t chunk = want < FALLBACK_READ ? want : FALLBACK_READ;
+    char buf[FALLBACK_READ];
+    ssize_t r = ::pread(s.block->fd, buf, chunk, s.offset);
+    if (r <= 0) {
+        errno = EIO;
+        return -1;
+    }
+    return ::write(fd, buf, static_cast<size_t>(r));
+}
+
+ssize_t Response::BufferChain::writeTo(int fd, size_t limit) {
+    size_t sent = 0;
+    while (!slices.empty() && sent < limit) {
+        const Slice& front = slices.front();
+        bool isFile = front.block != NULL && front.block->fd >= 0;
+        ssize_t n = isFile ? writeFile(fd, limit - sent) : writeMemory(fd, limit - sent);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            if (isFile) {
+                errno = EIO; // file shrank under us
+                return -1;
+            }
+            break;
+        }
+        consume(static_cast<size_t>(n));
+        sent += static_cast<size_t>(n);
+    }
+    return static_cast<ssize_t>(sent);
+}
+
+void Response::BufferChain::clear() {
+    while (!slices.empty()) {
+        consume(slices.front().len);
+    }
+    total = 0;
+    if (slab != NULL) {
+        slab->unref();
+        slab = NULL;
+        slabUsed = 0;
+    }
+}
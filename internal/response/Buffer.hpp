@@ -0,0 +1,125 @@
+#ifndef BUFFER_HPP
+#define BUFFER_HPP
+
+#include <cstddef>
+#include <deque>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+namespace Response {
+
+    // Reference-counted storage behind buffers and chain slices: heap
+    // bytes or an open file. Counts are atomic so shared bodies may be
+    // queued from more than one thread.
+    struct Block {
+        int refs;
+        char* bytes;
+        size_t cap;
+        int fd; // owned fd for file blocks, -1 otherwise
+
+        static Block* alloc(size_t cap);
+        static Block* file(int fd);
+        void ref() { __sync_fetch_and_add(&refs, 1); }
+        void unref();
+    };
+
+    // Immutable bytes shared by reference. Copying a Buffer only bumps a
+    // count, so one body can back any number of queued responses.
+    class Buffer {
+    public:
+        Buffer();
+        // Copies data once
+        Buffer(const char* data, size_t len);
+        Buffer(const Buffer& other);
+        Buffer& operator=(const Buffer& other);
+        ~Buffer();
+
+        // Refers to static storage without copying it
+        static Buffer wrap(const char* data, size_t len);
+
+        const char* data() const { return ptr; }
+        size_t size() const { return len; }
+        // NULL for static storage
+        Block* storage() const { return block; }
+
+    private:
+        Block* block;
+        const char* ptr;
+        size_t len;
+    };
+
+    // Outbound data as a queue of slices: small copies packed into
+    // shared slabs, references into Buffers, and file ranges. Writing it
+    // maps runs of memory slices onto writev and file ranges onto
+    // sendfile.
+    class BufferChain {
+    public:
+        BufferChain();
+        ~BufferChain();
+
+        // Copies data into the current slab
+        void appendCopy(const char* data, size_t len);
+        // Refers to part of buf without copying
+        void append(const Buffer& buf, size_t offset, size_t len);
+        // Queues a file range; fd is duplicated so the caller may close it
+        bool appendFile(int fd, off_t offset, size_t len);
+
+        bool empty() const { return slices.empty(); }
+        size_t size() const { return total; }
+        bool hasFile() const { return files > 0; }
+
+        // Fills iov with the leading memory slices and returns how many
+        // were used, or -1 if they do not all fit or a file slice is queued
+        int gather(struct iovec* iov, int max) const;
+        // Sends queued data until the chain is empty, the fd would block
+        // or limit bytes have gone out. Returns bytes sent or -1 on error.
+        ssize_t writeTo(int fd, size_t limit);
+        void clear();
+
+        // Sends memory slices of at least threshold bytes on fd with
+        // MSG_ZEROCOPY. Their blocks are held until the kernel reports
+        // completion on the socket error queue; reapCompletions releases
+        // them. False if the socket does not support zero-copy.
+        bool enableZeroCopy(int fd, size_t threshold);
+        // Reads pending completions without blocking; false on error
+        bool reapCompletions(int fd);
+        bool awaitingCompletions() const { return !inflight.empty(); }
+
+    private:
+        struct Slice {
+            Block* block; // NULL for static memory
+            const char* data;
+            size_t len;
+            off_t offset; // file slices only
+        };
+
+        // A zero-copy send the kernel may still be reading from
+        struct Inflight {
+            unsigned int id;
+            Block* block;
+        };
+
+        std::deque<Slice> slices;
+        size_t total;
+        int files;
+        Block* slab;
+        size_t slabUsed;
+        size_t zeroCopyMin; // 0 when zero-copy is off
+        unsigned int nextId;
+        std::deque<Inflight> inflight;
+
+        void push(Block* block, const char* data, size_t len, off_t offset);
+        void consume(size_t n);
+        ssize_t writeMemory(int fd, size_t limit);
+        ssize_t writeFile(int fd, size_t limit);
+        ssize_t writeZeroCopy(int fd, size_t limit);
+        bool zeroCopyable(const Slice& s) const;
+        void complete(unsigned int lo, unsigned int hi);
+
+        BufferChain(const BufferChain&);
+        BufferChain& operator=(const BufferChain&);
+    };
+
+}
+
+#endif
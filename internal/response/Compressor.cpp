@@ -0,0 +1,50 @@
+#include "Compressor.hpp"
+#include <cstring>
+
+static const int GZIP_WINDOW_BITS = 15 + 16;
+static const int DEFLATE_WINDOW_BITS = 15;
+static const int MEM_LEVEL = 8;
+
+Response::Compressor::Compressor(Encoding encoding) : ready(false) {
+    std::memset(&stream, 0, sizeof(stream));
+    int windowBits = encoding == EncodingGzip ? GZIP_WINDOW_BITS : DEFLATE_WINDOW_BITS;
+    ready = deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                         windowBits, MEM_LEVEL, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+Response::Compressor::~Compressor() {
+    if (ready) {
+        deflateEnd(&stream);
+    }
+}
+
+bool Response::Compressor::compress(const char* data, size_t len, int flush, std::string& out) {
+    if (!ready) {
+        return false;
+    }
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream.avail_in = static_cast<uInt>(len);
+    char buf[16384];
+    for (;;) {
+        stream.next_out = reinterpret_cast<Bytef*>(buf);
+        stream.avail_out = sizeof(buf);
+        int rc = deflate(&stream, flush);
+        if (rc == Z_STREAM_ERROR) {
+            return false;
+        }
+        out.append(buf, sizeof(buf) - stream.avail_out);
+        if (flush == Z_FINISH) {
+            if (rc == Z_STREAM_END) {
+                return true;
+            }
+        } else if (stream.avail_out != 0) {
+            return true;
+        }
+    }
+}
+
+bool Response::Compressor::compressAll(Encoding encoding, const char* data, size_t len,
+                                       std::string& out) {
+    Compressor c(encoding);
+    return c.compress(data, len, Z_FINISH, out);
+}
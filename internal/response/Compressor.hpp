@@ -0,0 +1,37 @@
+#ifndef COMPRESSOR_HPP
+#define COMPRESSOR_HPP
+
+#include <cstddef>
+#include <string>
+#include <zlib.h>
+#include "Response.hpp"
+
+namespace Response {
+
+    // Streaming gzip/deflate encoder for response bodies
+    class Compressor {
+    public:
+        Compressor(Encoding encoding);
+        ~Compressor();
+
+        bool ok() const { return ready; }
+
+        // Appends compressed output for data to out. flush is a zlib flush
+        // mode: Z_NO_FLUSH, Z_SYNC_FLUSH or Z_FINISH.
+        bool compress(const char* data, size_t len, int flush, std::string& out);
+
+        // Compresses a whole body in one go
+        static bool compressAll(Encoding encoding, const char* data, size_t len,
+                                std::string& out);
+
+    private:
+        z_stream stream;
+        bool ready;
+
+        Compressor(const Compressor&);
+        Compressor& operator=(const Compressor&);
+    };
+
+}
+
+#endif
@@ -1,9 +1,23 @@
 #include "Response.hpp"
+#include "TrailerDigest.hpp"
+#include "Compressor.hpp"
+#include "BodySource.hpp"
+#include "TokenBucket.hpp"
+#include "Util.hpp"
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
 #include <cstring>
-#include <cstdio>
 #include <sstream>
+#include <poll.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+static const int MAX_SEGMENTS = 16;
+static const size_t STREAM_BUF = 16 * 1024;
+static const size_t UNLIMITED = static_cast<size_t>(-1);
+static const char* const SERVER_NAME = "httpfromtcp";
+
 struct HeaderAppender {
     std::string& buf;
     HeaderAppender(std::string& b) : buf(b) {}
@@ -12,6 +26,117 @@ struct HeaderAppender {
     }
 };
 
+// Blocks until a non-blocking fd can take more data
+// POLLERR also signals queued zero-copy completions, which are no error
+static bool waitWritable(int fd) {
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLOUT;
+    for (;;) {
+        int n = poll(&p, 1, -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || (p.revents & POLLNVAL)) {
+            return false;
+        }
+        return !(p.revents & POLLERR) || !socketFailed(fd);
+    }
+}
+
+// Waits for the socket error queue, where zero-copy completions arrive
+static bool waitCompletion(int fd) {
+    struct pollfd p;
+    p.fd = fd;
+    p.events = 0;
+    for (;;) {
+        int n = poll(&p, 1, -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n > 0 && !(p.revents & (POLLHUP | POLLNVAL)) && !socketFailed(fd);
+    }
+}
+
+// Returns true if a failed write should simply be retried
+static bool retryWrite(int fd) {
+    if (errno == EINTR) {
+        return true;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return waitWritable(fd);
+    }
+    return false;
+}
+
+// Drops the first n bytes from an iovec array after a short write
+static void advance(struct iovec*& iov, int& count, size_t n) {
+    while (count > 0 && n >= iov->iov_len) {
+        n -= iov->iov_len;
+        ++iov;
+        --count;
+    }
+    if (count > 0) {
+        iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+        iov->iov_len -= n;
+    }
+}
+
+// Writes every segment, resuming after short writes, EINTR and EAGAIN
+static bool writeAllv(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t n = ::writev(fd, iov, count);
+        if (n < 0) {
+            if (retryWrite(fd)) {
+                continue;
+            }
+            return false;
+        }
+        advance(iov, count, static_cast<size_t>(n));
+    }
+    return true;
+}
+
+static int formatHex(char* out, size_t value) {
+    static const char digits[] = "0123456789abcdef";
+    char tmp[sizeof(size_t) * 2];
+    int n = 0;
+    do {
+        tmp[n++] = digits[value & 0xf];
+        value >>= 4;
+    } while (value != 0);
+    for (int i = 0; i < n; i++) {
+        out[i] = tmp[n - 1 - i];
+    }
+    return n;
+}
+
+static const char* statusLine(Response::StatusCode statusCode) {
+    switch (statusCode) {
+        case Response::StatusOk:
+            return "HTTP/1.1 200 OK\r\n";
+        case Response::StatusNoContent:
+            return "HTTP/1.1 204 No Content\r\n";
+        case Response::StatusPartialContent:
+            return "HTTP/1.1 206 Partial Content\r\n";
+        case Response::StatusNotModified:
+            return "HTTP/1.1 304 Not Modified\r\n";
+        case Response::StatusBadRequest:
+            return "HTTP/1.1 400 Bad Request\r\n";
+        case Response::StatusNotFound:
+            return "HTTP/1.1 404 Not Found\r\n";
+        case Response::StatusMethodNotAllowed:
+            return "HTTP/1.1 405 Method Not Allowed\r\n";
+        case Response::StatusRangeNotSatisfiable:
+            return "HTTP/1.1 416 Range Not Satisfiable\r\n";
+        case Response::StatusMisdirectedRequest:
+            return "HTTP/1.1 421 Misdirected Request\r\n";
+        case Response::StatusInternalServerError:
+            return "HTTP/1.1 500 Internal Server Error\r\n";
+    }
+    return NULL;
+}
+
 Headers Response::getDefaultHeaders(int contentLen) {
     Headers h;
     std::ostringstream oss;
@@ -22,53 +147,709 @@ Headers Response::getDefaultHeaders(int contentLen) {
     return h;
 }
 
-Response::Writer::Writer(int fd) : fd(fd) {}
+// Two decimal digits of v
+static void put2(char* out, int v) {
+    out[0] = static_cast<char>('0' + v / 10);
+    out[1] = static_cast<char>('0' + v % 10);
+}
 
-bool Response::Writer::writeStatusLine(StatusCode statusCode) const {
-    const char* statusLine = NULL;
-    switch (statusCode) {
-        case StatusOk:
-            statusLine = "HTTP/1.1 200 OK\r\n";
-            break;
-        case StatusBadRequest:
-            statusLine = "HTTP/1.1 400 Bad Request\r\n";
-            break;
-        case StatusInternalServerError:
-            statusLine = "HTTP/1.1 500 Internal Server Error\r\n";
+Response::DateCache::DateCache() : current(static_cast<time_t>(-1)) {
+    refresh(std::time(NULL));
+}
+
+// Formats t into out[0, 29)
+static bool formatDate(time_t t, char* out) {
+    static const char days[7][4] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    static const char months[12][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                       "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    struct tm tm;
+    if (gmtime_r(&t, &tm) == NULL) {
+        return false;
+    }
+    std::memcpy(out, days[tm.tm_wday], 3);
+    out[3] = ',';
+    out[4] = ' ';
+    put2(out + 5, tm.tm_mday);
+    out[7] = ' ';
+    std::memcpy(out + 8, months[tm.tm_mon], 3);
+    out[11] = ' ';
+    int year = tm.tm_year + 1900;
+    put2(out + 12, year / 100);
+    put2(out + 14, year % 100);
+    out[16] = ' ';
+    put2(out + 17, tm.tm_hour);
+    out[19] = ':';
+    put2(out + 20, tm.tm_min);
+    out[22] = ':';
+    put2(out + 23, tm.tm_sec);
+    std::memcpy(out + 25, " GMT", 4);
+    return true;
+}
+
+std::string Response::httpDate(time_t t) {
+    char date[29];
+    if (!formatDate(t, date)) {
+        return "";
+    }
+    return std::string(date, sizeof(date));
+}
+
+const char* Response::encodingName(Encoding encoding) {
+    switch (encoding) {
+        case EncodingGzip:
+            return "gzip";
+        case EncodingDeflate:
+            return "deflate";
+        case EncodingIdentity:
             break;
-        default:
-            return false;
     }
-    size_t len = std::strlen(statusLine);
-    ssize_t n = ::write(fd, statusLine, len);
-    return n == static_cast<ssize_t>(len);
+    return "identity";
+}
+
+static std::string lowerTrimmed(const std::string& s, size_t begin, size_t end) {
+    while (begin < end && std::isspace(static_cast<unsigned char>(s[begin]))) {
+        ++begin;
+    }
+    while (end > begin && std::isspace(static_cast<unsigned char>(s[end - 1]))) {
+        --end;
+    }
+    std::string out;
+    for (size_t i = begin; i < end; i++) {
+        out += static_cast<char>(std::tolower(static_cast<unsigned char>(s[i])));
+    }
+    return out;
+}
+
+double Response::encodingQuality(const std::string& acceptEncoding, const std::string& coding) {
+    double codingQ = -1, anyQ = -1;
+    size_t pos = 0;
+    while (pos <= acceptEncoding.size()) {
+        size_t comma = acceptEncoding.find(',', pos);
+        if (comma == std::string::npos) {
+            comma = acceptEncoding.size();
+        }
+        size_t semi = acceptEncoding.find(';', pos);
+        size_t nameEnd = (semi != std::string::npos && semi < comma) ? semi : comma;
+        std::string name = lowerTrimmed(acceptEncoding, pos, nameEnd);
+        double q = 1;
+        if (nameEnd < comma) {
+            std::string param = lowerTrimmed(acceptEncoding, nameEnd + 1, comma);
+            if (param.compare(0, 2, "q=") == 0) {
+                q = std::atof(param.c_str() + 2);
+            }
+        }
+        if (name == coding || (coding == "gzip" && name == "x-gzip")) {
+            codingQ = q;
+        } else if (name == "*") {
+            anyQ = q;
+        }
+        pos = comma + 1;
+    }
+    return codingQ >= 0 ? codingQ : anyQ;
 }
 
-bool Response::Writer::writeHeaders(const Headers& h) const {
+Response::Encoding Response::negotiateEncoding(const std::string& acceptEncoding) {
+    double gzipQ = encodingQuality(acceptEncoding, "gzip");
+    double deflateQ = encodingQuality(acceptEncoding, "deflate");
+    if (gzipQ > 0 && gzipQ >= deflateQ) {
+        return EncodingGzip;
+    }
+    if (deflateQ > 0) {
+        return EncodingDeflate;
+    }
+    return EncodingIdentity;
+}
+
+void Response::DateCache::refresh(time_t now) {
+    if (now == current) {
+        return;
+    }
+    char date[29];
+    if (!formatDate(now, date)) {
+        return;
+    }
+    current = now;
+
+    buf = "date: ";
+    buf.append(date, sizeof(date));
+    buf += "\r\nserver: ";
+    buf += SERVER_NAME;
+    buf += "\r\n";
+}
+
+Response::Prepared::Prepared(StatusCode statusCode, const Headers& h,
+                             const char* body, size_t len)
+    : status(statusCode), headers(h), slotPos(0) {
+    variants[EncodingIdentity] = this;
+    variants[EncodingGzip] = NULL;
+    variants[EncodingDeflate] = NULL;
+
+    Headers withLength = h;
+    std::ostringstream oss;
+    oss << len;
+    withLength.replace("Content-Length", oss.str());
+    // Every variant carries the same Vary, whichever coding it ends up in
+    if (len > 0 && h.get("content-encoding").empty()) {
+        withLength.set("Vary", "Accept-Encoding");
+        headers.set("Vary", "Accept-Encoding");
+    }
+
+    std::string out;
+    const char* line = statusLine(statusCode);
+    if (line != NULL) {
+        out += line;
+    }
+    withLength.forEach(HeaderAppender(out));
+    slotPos = out.size();
+    out += "\r\n";
+    out.append(body, len);
+    buf = Buffer(out.data(), out.size());
+}
+
+Response::Prepared::~Prepared() {
+    for (int i = 0; i < 3; i++) {
+        if (variants[i] != this) {
+            delete variants[i];
+        }
+    }
+}
+
+const Response::Prepared& Response::Prepared::variant(Encoding encoding) const {
+    if (variants[encoding] != NULL) {
+        return *variants[encoding];
+    }
+    const char* body = buf.data() + slotPos + 2;
+    size_t bodyLen = buf.size() - slotPos - 2;
+    std::string compressed;
+    if (Compressor::compressAll(encoding, body, bodyLen, compressed) &&
+        compressed.size() < bodyLen) {
+        Headers h = headers;
+        h.replace("Content-Encoding", encodingName(encoding));
+        variants[encoding] = new Prepared(status, h, compressed.data(), compressed.size());
+    } else {
+        variants[encoding] = this;
+    }
+    return *variants[encoding];
+}
+
+Response::Writer::Writer(int fd, const DateCache* dates)
+    : fd(fd), dates(dates), chunkTarget(0), chunkDelayMs(0),
+      encoding(EncodingIdentity), compressor(NULL), holding(false), heldLength(0),
+      chunked(false), nonBlocking(false), budget(UNLIMITED), source(NULL),
+      bucket(NULL), headOnly(false), fileStreamed(false), captureSink(NULL), captureDates(0) {
+    chunkStart.tv_sec = 0;
+    chunkStart.tv_nsec = 0;
+}
+
+Response::Writer::~Writer() {
+    delete compressor;
+    delete source;
+    delete bucket;
+}
+
+bool Response::Writer::writeSegments(struct iovec* segs, int count) {
+    if (headOnly) {
+        // Body bytes and chunk framing are dropped; headers still go out
+        return drain();
+    }
+    for (int i = 0; i < count; i++) {
+        captureBytes(static_cast<const char*>(segs[i].iov_base), segs[i].iov_len);
+    }
+    if (!nonBlocking && fd >= 0) {
+        // Caller data goes out straight from its buffer in the same writev
+        struct iovec iov[MAX_SEGMENTS];
+        int n = out.gather(iov, MAX_SEGMENTS - count);
+        if (n >= 0) {
+            for (int i = 0; i < count; i++) {
+                if (segs[i].iov_len > 0) {
+                    iov[n++] = segs[i];
+                }
+            }
+            bool ok = writeAllv(fd, iov, n);
+            out.clear();
+            return ok;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        out.appendCopy(static_cast<const char*>(segs[i].iov_base), segs[i].iov_len);
+    }
+    return drain();
+}
+
+bool Response::Writer::writeStatusLine(StatusCode statusCode) {
+    const char* line = statusLine(statusCode);
+    if (line == NULL) {
+        return false;
+    }
+    out.append(Buffer::wrap(line, std::strlen(line)), 0, std::strlen(line));
+    captureBytes(line, std::strlen(line));
+    captureDateSlot();
+    if (dates != NULL) {
+        out.appendCopy(dates->lines().data(), dates->lines().size());
+    }
+    return true;
+}
+
+bool Response::Writer::writeHeaders(const Headers& h) {
+    chunked = h.get("transfer-encoding") == "chunked";
+    if (trailers.empty() && encoding == EncodingIdentity) {
+        appendHeaders(h);
+        return true;
+    }
+
+    Headers full = h;
+    for (size_t i = 0; i < trailers.size(); i++) {
+        full.set("Trailer", trailers[i].name);
+    }
+    if (encoding != EncodingIdentity) {
+        long length = std::atol(h.get("content-length").c_str());
+        if (chunked) {
+            compressor = new Compressor(encoding);
+            full.replace("Content-Encoding", encodingName(encoding));
+            full.set("Vary", "Accept-Encoding");
+        } else if (length > 0) {
+            // Wait for the whole body so Content-Length can be corrected
+            holding = true;
+            heldLength = static_cast<size_t>(length);
+            heldHeaders = full;
+            return true;
+        }
+    }
+    appendHeaders(full);
+    return true;
+}
+
+void Response::Writer::appendHeaders(const Headers& h) {
     std::string buf;
     h.forEach(HeaderAppender(buf));
     buf += "\r\n";
-    ssize_t n = ::write(fd, buf.c_str(), buf.size());
-    return n == static_cast<ssize_t>(buf.size());
+    out.appendCopy(buf.data(), buf.size());
+    captureBytes(buf.data(), buf.size());
+}
+
+void Response::Writer::capture(std::string* sink) {
+    captureSink = sink;
+    captureDates = 0;
+}
+
+void Response::Writer::captureBytes(const char* data, size_t len) {
+    if (captureSink != NULL) {
+        captureSink->append(data, len);
+    }
+}
+
+void Response::Writer::captureDateSlot() {
+    if (captureSink != NULL && captureDates == 0) {
+        captureDates = captureSink->size();
+    }
+}
+
+void Response::Writer::setEncoding(Encoding e) {
+    encoding = e;
+}
+
+void Response::Writer::releaseHeld() {
+    holding = false;
+    appendHeaders(heldHeaders);
+    out.appendCopy(heldBody.data(), heldBody.size());
+    captureBytes(heldBody.data(), heldBody.size());
+    heldBody.clear();
+}
+
+bool Response::Writer::writeHeld() {
+    holding = false;
+    std::string compressed;
+    bool smaller = Compressor::compressAll(encoding, heldBody.data(), heldBody.size(), compressed) &&
+                   compressed.size() < heldBody.size();
+    heldHeaders.set("Vary", "Accept-Encoding");
+    if (smaller) {
+        std::ostringstream oss;
+        oss << compressed.size();
+        heldHeaders.replace("Content-Length", oss.str());
+        heldHeaders.replace("Content-Encoding", encodingName(encoding));
+    } else {
+        compressed.swap(heldBody);
+    }
+    appendHeaders(heldHeaders);
+    heldBody.clear();
+
+    struct iovec seg;
+    seg.iov_base = const_cast<char*>(compressed.data());
+    seg.iov_len = compressed.size();
+    return writeSegments(&seg, 1);
+}
+
+void Response::Writer::addTrailer(const std::string& name, TrailerDigest& digest) {
+    Trailer t;
+    t.name = name;
+    t.digest = &digest;
+    trailers.push_back(t);
+}
+
+bool Response::Writer::writeBody(const char* data, size_t len) {
+    if (holding) {
+        heldBody.append(data, len);
+        if (heldBody.size() < heldLength) {
+            return true;
+        }
+        return writeHeld();
+    }
+    struct iovec seg;
+    seg.iov_base = const_cast<char*>(data);
+    seg.iov_len = len;
+    return writeSegments(&seg, 1);
 }
 
-bool Response::Writer::writeBody(const char* data, size_t len) const {
-    ssize_t n = ::write(fd, data, len);
-    return n == static_cast<ssize_t>(len);
+void Response::Writer::setChunking(size_t targetSize, long maxDelayMs) {
+    chunkTarget = targetSize;
+    chunkDelayMs = maxDelayMs;
 }
 
-bool Response::Writer::writeChunkedBody(const char* data, size_t len) const {
+bool Response::Writer::chunkDeadlinePassed() const {
+    if (chunkDelayMs <= 0) {
+        return false;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsedMs = (now.tv_sec - chunkStart.tv_sec) * 1000
+                     + (now.tv_nsec - chunkStart.tv_nsec) / 1000000;
+    return elapsedMs >= chunkDelayMs;
+}
+
+bool Response::Writer::writeChunk(const char* extra, size_t extraLen, bool last) {
+    struct iovec segs[5];
+    int n = 0;
     char hexBuf[32];
-    int hexLen = std::sprintf(hexBuf, "%x\r\n", static_cast<unsigned int>(len));
-    if (!writeBody(hexBuf, hexLen)) {
+    size_t len = chunkBuf.size() + extraLen;
+    if (len > 0) {
+        int hexLen = formatHex(hexBuf, len);
+        hexBuf[hexLen++] = '\r';
+        hexBuf[hexLen++] = '\n';
+        segs[n].iov_base = hexBuf;
+        segs[n++].iov_len = hexLen;
+        segs[n].iov_base = const_cast<char*>(chunkBuf.data());
+        segs[n++].iov_len = chunkBuf.size();
+        segs[n].iov_base = const_cast<char*>(extra);
+        segs[n++].iov_len = extraLen;
+        segs[n].iov_base = const_cast<char*>("\r\n");
+        segs[n++].iov_len = 2;
+    }
+    std::string trailerBlock;
+    if (last && !trailers.empty()) {
+        trailerBlock = "0\r\n";
+        for (size_t i = 0; i < trailers.size(); i++) {
+            trailerBlock += trailers[i].name + ": " + trailers[i].digest->value() + "\r\n";
+        }
+        trailerBlock += "\r\n";
+        segs[n].iov_base = const_cast<char*>(trailerBlock.data());
+        segs[n++].iov_len = trailerBlock.size();
+    } else if (last) {
+        segs[n].iov_base = const_cast<char*>("0\r\n\r\n");
+        segs[n++].iov_len = 5;
+    }
+    bool ok = writeSegments(segs, n);
+    chunkBuf.clear();
+    return ok;
+}
+
+bool Response::Writer::writeChunkData(const char* data, size_t len) {
+    if (chunkTarget == 0) {
+        return len == 0 || writeChunk(data, len, false);
+    }
+    if (len == 0) {
+        return true;
+    }
+    if (chunkBuf.empty()) {
+        clock_gettime(CLOCK_MONOTONIC, &chunkStart);
+    }
+    // Large writes are framed straight from the caller's buffer
+    if (chunkBuf.size() + len >= chunkTarget || chunkDeadlinePassed()) {
+        return writeChunk(data, len, false);
+    }
+    chunkBuf.append(data, len);
+    return true;
+}
+
+bool Response::Writer::writeChunkedBody(const char* data, size_t len) {
+    if (chunkTarget == 0 && len == 0) {
+        return writeChunkedBodyDone();
+    }
+    for (size_t i = 0; i < trailers.size(); i++) {
+        trailers[i].digest->update(data, len);
+    }
+    if (compressor == NULL) {
+        return writeChunkData(data, len);
+    }
+    // Without coalescing every call still produces a chunk
+    std::string compressed;
+    int mode = chunkTarget == 0 ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+    if (!compressor->compress(data, len, mode, compressed)) {
         return false;
     }
-    if (!writeBody(data, len)) {
+    return writeChunkData(compressed.data(), compressed.size());
+}
+
+bool Response::Writer::writeChunkedBodyDone() {
+    if (compressor == NULL) {
+        return writeChunk(NULL, 0, true);
+    }
+    std::string compressed;
+    bool ok = compressor->compress(NULL, 0, Z_FINISH, compressed);
+    delete compressor;
+    compressor = NULL;
+    return writeChunk(compressed.data(), compressed.size(), true) && ok;
+}
+
+bool Response::Writer::writeFile(int fileFd, off_t offset, size_t length) {
+    if (holding) {
+        releaseHeld();
+    }
+    if (headOnly) {
+        return drain();
+    }
+    captureSink = NULL;
+    if (!out.appendFile(fileFd, offset, length)) {
         return false;
     }
-    return writeBody("\r\n", 2);
+    return drain();
 }
 
-bool Response::Writer::writeChunkedBodyDone() const {
-    return writeBody("0\r\n\r\n", 5);
+bool Response::Writer::streamFile(int fileFd, off_t offset, size_t length) {
+    if (holding) {
+        releaseHeld();
+    }
+    if (headOnly || length == 0) {
+        return true;
+    }
+    captureSink = NULL;
+    if (!out.appendFile(fileFd, offset, length)) {
+        return false;
+    }
+    fileStreamed = true;
+    return nonBlocking ? drain() : true;
+}
+
+bool Response::Writer::writeBody(const Buffer& body) {
+    if (holding) {
+        return writeBody(body.data(), body.size());
+    }
+    if (!headOnly) {
+        out.append(body, 0, body.size());
+        captureBytes(body.data(), body.size());
+    }
+    return drain();
+}
+
+bool Response::Writer::writePrepared(const Prepared& response) {
+    const Prepared& p = response.variant(encoding);
+    const Buffer& data = p.data();
+    // The slot is followed by the blank line and the body
+    size_t rest = headOnly ? 2 : data.size() - p.slot();
+    return writeSerialized(data, p.slot(), p.slot() + rest);
+}
+
+bool Response::Writer::writeSerialized(const Buffer& data, size_t slot) {
+    return writeSerialized(data, slot, data.size());
+}
+
+bool Response::Writer::writeSerialized(const Buffer& data, size_t slot, size_t end) {
+    out.append(data, 0, slot);
+    captureBytes(data.data(), slot);
+    captureDateSlot();
+    if (dates != NULL) {
+        out.appendCopy(dates->lines().data(), dates->lines().size());
+    }
+    out.append(data, slot, end - slot);
+    captureBytes(data.data() + slot, end - slot);
+    return drain();
+}
+
+bool Response::Writer::setZeroCopy(size_t threshold) {
+    return out.enableZeroCopy(fd, threshold);
+}
+
+bool Response::Writer::flush() {
+    if (holding) {
+        return writeHeld();
+    }
+    if (compressor != NULL) {
+        std::string compressed;
+        if (!compressor->compress(NULL, 0, Z_SYNC_FLUSH, compressed)) {
+            return false;
+        }
+        if (!chunkBuf.empty() || !compressed.empty()) {
+            return writeChunk(compressed.data(), compressed.size(), false);
+        }
+    }
+    if (!chunkBuf.empty()) {
+        return writeChunk(NULL, 0, false);
+    }
+    return drain();
+}
+
+void Response::Writer::stream(BodySource* s) {
+    delete source;
+    if (headOnly) {
+        delete s;
+        s = NULL;
+    }
+    if (s != NULL) {
+        captureSink = NULL;
+    }
+    source = s;
+}
+
+void Response::Writer::suppressBody() {
+    headOnly = true;
+}
+
+void Response::Writer::setNonBlocking() {
+    nonBlocking = true;
+}
+
+bool Response::Writer::drain() {
+    if (fd < 0) {
+        // A capture-only writer
+        out.clear();
+        return true;
+    }
+    if (fileStreamed && !nonBlocking) {
+        // The loop sends it
+        return true;
+    }
+    while (!out.empty()) {
+        ssize_t n = out.writeTo(fd, nonBlocking ? budget : UNLIMITED);
+        if (n < 0) {
+            return false;
+        }
+        if (nonBlocking) {
+            if (budget != UNLIMITED) {
+                budget -= static_cast<size_t>(n);
+            }
+            break;
+        }
+        if (out.empty()) {
+            break;
+        }
+        if (!waitWritable(fd)) {
+            return false;
+        }
+    }
+    if (!out.reapCompletions(fd)) {
+        return false;
+    }
+    if (!nonBlocking) {
+        // Zero-copy buffers may not be released until the kernel is done
+        while (out.awaitingCompletions()) {
+            if (!waitCompletion(fd) || !out.reapCompletions(fd)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+Response::Writer::Progress Response::Writer::pump() {
+    size_t quota = UNLIMITED;
+    return pump(quota);
+}
+
+Response::Writer::Progress Response::Writer::pump(size_t& quota) {
+    size_t allowed = quota;
+    bool paced = false;
+    if (bucket != NULL) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        size_t tokens = bucket->available(now);
+        if (tokens < allowed) {
+            allowed = tokens;
+            paced = true;
+        }
+    }
+
+    budget = allowed;
+    Progress progress = pumpSome();
+    size_t sent = allowed - budget;
+    budget = UNLIMITED;
+
+    if (quota != UNLIMITED) {
+        quota -= sent;
+    }
+    if (bucket != NULL) {
+        bucket->consume(sent);
+    }
+    if (progress == Yield && paced) {
+        return Paced;
+    }
+    return progress;
+}
+
+void Response::Writer::setRateLimit(size_t bytesPerSecond, size_t burst) {
+    delete bucket;
+    bucket = NULL;
+    if (bytesPerSecond > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        bucket = new TokenBucket(bytesPerSecond, burst > 0 ? burst : 1, now);
+    }
+}
+
+long Response::Writer::pacingDelayMs() const {
+    if (bucket == NULL) {
+        return 0;
+    }
+    // Wake for a full read's worth rather than a trickle
+    return bucket->delayMs(STREAM_BUF);
+}
+
+Response::Writer::Progress Response::Writer::pumpSome() {
+    char buf[STREAM_BUF];
+    for (;;) {
+        if (!drain()) {
+            return Broken;
+        }
+        if (!out.empty()) {
+            return budget == 0 ? Yield : WantWrite;
+        }
+        if (source == NULL) {
+            if (!flush()) {
+                return Broken;
+            }
+            if (!out.empty()) {
+                return budget == 0 ? Yield : WantWrite;
+            }
+            return out.awaitingCompletions() ? WantCompletion : Done;
+        }
+        if (budget == 0) {
+            return Yield;
+        }
+
+        size_t n = 0;
+        bool ok = true;
+        switch (source->read(buf, sizeof(buf), n)) {
+            case BodySource::Ready:
+                ok = chunked ? writeChunkedBody(buf, n) : writeBody(buf, n);
+                break;
+            case BodySource::Pending:
+                // Send what has been coalesced while the source is idle
+                if (!flush()) {
+                    return Broken;
+                }
+                if (out.empty()) {
+                    return WantSource;
+                }
+                return budget == 0 ? Yield : WantWrite;
+            case BodySource::Finished:
+                // Trailer digests may live in the source, so it goes last
+                ok = chunked ? writeChunkedBodyDone() : flush();
+                delete source;
+                source = NULL;
+                break;
+            case BodySource::Failed:
+                return Broken;
+        }
+        if (!ok) {
+            return Broken;
+        }
+    }
 }
@@ -1,30 +1,263 @@
 #ifndef RESPONSE_HPP
 #define RESPONSE_HPP
 
+#include <string>
+#include <vector>
+#include <ctime>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include "Headers.hpp"
+#include "Buffer.hpp"
 
 namespace Response {
 
     enum StatusCode {
         StatusOk = 200,
+        StatusNoContent = 204,
+        StatusPartialContent = 206,
+        StatusNotModified = 304,
         StatusBadRequest = 400,
+        StatusNotFound = 404,
+        StatusMethodNotAllowed = 405,
+        StatusRangeNotSatisfiable = 416,
+        StatusMisdirectedRequest = 421,
         StatusInternalServerError = 500
     };
 
+    // Content codings; values index Prepared's variant cache
+    enum Encoding {
+        EncodingIdentity = 0,
+        EncodingGzip = 1,
+        EncodingDeflate = 2
+    };
+
+    class TrailerDigest;
+    class Compressor;
+    class BodySource;
+    class TokenBucket;
+
     Headers getDefaultHeaders(int contentLen);
 
+    // IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"; empty if t is out
+    // of range
+    std::string httpDate(time_t t);
+
+    // Picks the best supported coding from an Accept-Encoding value
+    Encoding negotiateEncoding(const std::string& acceptEncoding);
+    // The q-value an Accept-Encoding value gives coding, directly or
+    // through "*"; -1 if it names neither
+    double encodingQuality(const std::string& acceptEncoding, const std::string& coding);
+    const char* encodingName(Encoding encoding);
+
+    // Date and Server header lines formatted at most once per second. The
+    // event loop refreshes it from its timer and writers copy the lines
+    // into each status line and prepared response they send.
+    class DateCache {
+    public:
+        DateCache();
+
+        void refresh(time_t now);
+        const std::string& lines() const { return buf; }
+
+    private:
+        time_t current;
+        std::string buf;
+    };
+
+    // A complete response serialized once up front, for bodies that never
+    // change. Content-Length is filled in from the body, and a body that
+    // may be negotiated into another coding gets Vary: Accept-Encoding on
+    // every variant. The buffer keeps a slot between the headers and the
+    // blank line where per-response header lines can be spliced in when it
+    // is written.
+    class Prepared {
+    public:
+        Prepared(StatusCode statusCode, const Headers& h, const char* body, size_t len);
+        ~Prepared();
+
+        const Buffer& data() const { return buf; }
+        size_t slot() const { return slotPos; }
+
+        // The response with its body in the given coding. Compressed
+        // variants are built on first use and kept; if compression does
+        // not make the body smaller the response itself is returned.
+        const Prepared& variant(Encoding encoding) const;
+
+    private:
+        StatusCode status;
+        Headers headers;
+        Buffer buf;
+        size_t slotPos;
+        mutable const Prepared* variants[3];
+
+        Prepared(const Prepared&);
+        Prepared& operator=(const Prepared&);
+    };
+
+    // Output is queued on a BufferChain. Status line and headers go out
+    // together with the first body segment in a single writev; call
+    // flush() to push out a response that has no body.
     class Writer {
     public:
-        Writer(int fd);
+        Writer(int fd, const DateCache* dates = NULL);
+        ~Writer();
+
+        bool writeStatusLine(StatusCode statusCode);
+        bool writeHeaders(const Headers& h);
+        bool writeBody(const char* data, size_t len);
+        // Queues a shared body by reference, without copying it
+        bool writeBody(const Buffer& body);
+        // Each call is one chunk unless coalescing is enabled with setChunking
+        bool writeChunkedBody(const char* data, size_t len);
+        // Sends the terminating chunk followed by any declared trailers
+        bool writeChunkedBodyDone();
+        // Declares a trailer whose value is computed by digest from the
+        // chunked body. Must be called before writeHeaders, which adds the
+        // Trailer header. The digest must outlive the response.
+        void addTrailer(const std::string& name, TrailerDigest& digest);
+        // Buffers chunked output until targetSize bytes are collected or
+        // maxDelayMs has passed since the first buffered byte. The delay is
+        // checked on each write; flush() sends a partial chunk immediately.
+        // A targetSize of 0 turns coalescing off, a maxDelayMs of 0 waits
+        // for the target size or an explicit flush.
+        void setChunking(size_t targetSize, long maxDelayMs);
+        // Compresses the body with the given coding. Must be called before
+        // writeHeaders. Chunked bodies are compressed as a stream;
+        // Content-Length bodies are collected and sent compressed once the
+        // declared length has arrived. File bodies are sent as is: a file
+        // write sends the held headers, and any body held so far,
+        // uncompressed.
+        void setEncoding(Encoding e);
+        // Sends length bytes of fileFd starting at offset with sendfile(2),
+        // so file data goes from the page cache to the socket without a copy.
+        // The range is queued on a duplicate of fileFd, so the caller may
+        // close it right away.
+        bool writeFile(int fileFd, off_t offset, size_t length);
+        // Sends a whole prepared response with one writev, with the
+        // cached Date and Server lines spliced into its slot
+        bool writePrepared(const Prepared& p);
+        // Sends a response serialized without Date and Server lines, e.g.
+        // by capture(), with the cached lines spliced in at slot. The
+        // bytes go out as they are, body included.
+        bool writeSerialized(const Buffer& data, size_t slot);
+        // Sends shared buffers of at least threshold bytes with
+        // MSG_ZEROCOPY instead of copying them into the kernel. The writer
+        // holds them until the completion notifications arrive and is not
+        // done before that. Smaller output is copied as usual. False if the
+        // socket does not support it (e.g. Unix sockets).
+        bool setZeroCopy(size_t threshold);
+        bool flush();
+
+        // Answers HEAD: status line and headers, Content-Length included,
+        // go out as usual but every body write is dropped
+        void suppressBody();
+
+        // Copies the response into sink as it is queued, leaving out the
+        // Date and Server lines and recording where they were. Writers on
+        // fd -1 only capture. File and streamed bodies cannot be copied and
+        // end the capture.
+        void capture(std::string* sink);
+        // False once the capture was cut short
+        bool captured() const { return captureSink != NULL; }
+        size_t captureSlot() const { return captureDates; }
+
+        // Hands the rest of the body to the event loop. The writer takes
+        // ownership of source; its output is chunk-framed if the headers
+        // declared chunked transfer encoding.
+        void stream(BodySource* source);
+        BodySource* bodySource() const { return source; }
+        // Queues a file range for the event loop to send with sendfile(2),
+        // under the connection's write quota and rate limit, as it does
+        // for stream(). Until the loop takes over, later writes of a
+        // blocking writer queue behind it. The range is sent from a
+        // duplicate of fileFd.
+        bool streamFile(int fileFd, off_t offset, size_t length);
+        // True if the event loop has to finish the response
+        bool pending() const { return source != NULL || fileStreamed; }
 
-        bool writeStatusLine(StatusCode statusCode) const;
-        bool writeHeaders(const Headers& h) const;
-        bool writeBody(const char* data, size_t len) const;
-        bool writeChunkedBody(const char* data, size_t len) const;
-        bool writeChunkedBodyDone() const;
+        enum Progress {
+            WantWrite,  // output is queued until the socket is writable
+            WantSource, // waiting for the body source's waitFd()
+            Yield,      // the write quota ran out; more can be sent now
+            Paced,      // the rate limit ran out; retry after pacingDelayMs()
+            WantCompletion, // waiting for zero-copy completions (EPOLLERR)
+            Done,
+            Broken
+        };
+        // Switches to non-blocking output: writes that would block are
+        // queued and sent by pump() instead of waiting
+        void setNonBlocking();
+        // Sends queued output, then pulls from the body source, until the
+        // socket or the source would block or the response is complete
+        Progress pump();
+        // Same, but sends at most quota bytes and deducts what went out
+        Progress pump(size_t& quota);
+
+        // Caps streamed output at bytesPerSecond with a token bucket that
+        // holds up to burst bytes. Output sent by pump() is paced; when the
+        // bucket runs dry pump() returns Paced. 0 removes the limit. A burst
+        // of 0 is raised to 1 byte so the bucket can ever refill.
+        void setRateLimit(size_t bytesPerSecond, size_t burst);
+        // How long a Paced writer should wait before pumping again
+        long pacingDelayMs() const;
 
     private:
+        struct Trailer {
+            std::string name;
+            TrailerDigest* digest;
+        };
+
         int fd;
+        const DateCache* dates;
+        BufferChain out;
+        std::vector<Trailer> trailers;
+
+        size_t chunkTarget;
+        long chunkDelayMs;
+        std::string chunkBuf;
+        struct timespec chunkStart;
+
+        Encoding encoding;
+        Compressor* compressor;
+        bool holding;
+        size_t heldLength;
+        Headers heldHeaders;
+        std::string heldBody;
+
+        bool chunked;
+        bool nonBlocking;
+        size_t budget; // bytes drain() may still send in non-blocking mode
+        BodySource* source;
+        TokenBucket* bucket;
+        bool headOnly;
+        bool fileStreamed;
+        std::string* captureSink;
+        size_t captureDates; // offset in the capture of the Date line
+
+        Writer(const Writer&);
+        Writer& operator=(const Writer&);
+
+        // Writes queued output followed by the given segments
+        bool writeSegments(struct iovec* segs, int count);
+        void appendHeaders(const Headers& h);
+        void captureBytes(const char* data, size_t len);
+        void captureDateSlot();
+        // Sends data[0, end) with the Date and Server lines at slot
+        bool writeSerialized(const Buffer& data, size_t slot, size_t end);
+        // Frames buffered chunk data plus extra as one chunk, optionally
+        // followed by the terminating chunk
+        bool writeChunk(const char* extra, size_t extraLen, bool last);
+        // Frames data as chunks, coalescing if enabled
+        bool writeChunkData(const char* data, size_t len);
+        // Sends held headers and the compressed held body
+        bool writeHeld();
+        // Queues held headers and body as they are, for a file body
+        void releaseHeld();
+        // Sends queued output, waiting for the socket unless non-blocking.
+        // False on a socket error.
+        bool drain();
+        bool chunkDeadlinePassed() const;
+        Progress pumpSome();
     };
 
 }
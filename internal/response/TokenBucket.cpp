@@ -0,0 +1,34 @@
+#include "TokenBucket.hpp"
+
+Response::TokenBucket::TokenBucket(size_t bytesPerSecond, size_t burstBytes, const struct timespec& now)
+    : rate(static_cast<double>(bytesPerSecond)), burst(static_cast<double>(burstBytes)),
+      tokens(static_cast<double>(burstBytes)), last(now) {}
+
+size_t Response::TokenBucket::available(const struct timespec& now) {
+    double elapsed = static_cast<double>(now.tv_sec - last.tv_sec)
+                     + static_cast<double>(now.tv_nsec - last.tv_nsec) / 1e9;
+    if (elapsed > 0) {
+        tokens += elapsed * rate;
+        if (tokens > burst) {
+            tokens = burst;
+        }
+        last = now;
+    }
+    return static_cast<size_t>(tokens);
+}
+
+void Response::TokenBucket::consume(size_t n) {
+    tokens -= static_cast<double>(n);
+}
+
+long Response::TokenBucket::delayMs(size_t want) const {
+    double need = static_cast<double>(want);
+    if (need > burst) {
+        need = burst;
+    }
+    if (tokens >= need || rate <= 0) {
+        return 0;
+    }
+    // Round up so the wakeup never comes early
+    return static_cast<long>((need - tokens) * 1000 / rate) + 1;
+}
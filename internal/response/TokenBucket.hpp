@@ -0,0 +1,32 @@
+#ifndef TOKENBUCKET_HPP
+#define TOKENBUCKET_HPP
+
+#include <cstddef>
+#include <ctime>
+
+namespace Response {
+
+    // Byte budget that refills at a fixed rate up to a burst size. Time is
+    // passed in so callers can use one clock reading per loop iteration.
+    class TokenBucket {
+    public:
+        // Starts full
+        TokenBucket(size_t bytesPerSecond, size_t burst, const struct timespec& now);
+
+        // Whole bytes that may be sent at now
+        size_t available(const struct timespec& now);
+        void consume(size_t n);
+        // Milliseconds until at least want bytes are available, 0 if they
+        // already are. want is capped at the burst size.
+        long delayMs(size_t want) const;
+
+    private:
+        double rate;
+        double burst;
+        double tokens;
+        struct timespec last;
+    };
+
+}
+
+#endif
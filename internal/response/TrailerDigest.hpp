@@ -0,0 +1,52 @@
+#ifndef TRAILERDIGEST_HPP
+#define TRAILERDIGEST_HPP
+
+#include <cstddef>
+#include <string>
+#include "Sha256.hpp"
+
+namespace Response {
+
+    // Computes a trailer field value from a chunked body as it is written
+    class TrailerDigest {
+    public:
+        virtual void update(const char* data, size_t len) = 0;
+        virtual std::string value() = 0;
+        virtual ~TrailerDigest() {}
+    };
+
+    // Body length in decimal
+    class LengthDigest : public TrailerDigest {
+    public:
+        LengthDigest();
+        void update(const char* data, size_t len);
+        std::string value();
+
+    private:
+        size_t total;
+    };
+
+    // CRC-32 (IEEE) as 8 hex digits
+    class Crc32Digest : public TrailerDigest {
+    public:
+        Crc32Digest();
+        void update(const char* data, size_t len);
+        std::string value();
+
+    private:
+        unsigned int crc;
+    };
+
+    // SHA-256 as 64 hex digits
+    class Sha256Digest : public TrailerDigest {
+    public:
+        void update(const char* data, size_t len);
+        std::string value();
+
+    private:
+        Crypto::Sha256 ctx;
+    };
+
+}
+
+#endif
@@ -0,0 +1,237 @@
+#include "FileResponse.hpp"
+#include "Request.hpp"
+#include "Util.hpp"
+#include <algorithm>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace FileResponse {
+
+    // Digits only, no sign or overflow
+    static bool parseOffset(const std::string& s, off_t& out) {
+        if (s.empty() || s.size() > 18) {
+            return false;
+        }
+        off_t v = 0;
+        for (size_t i = 0; i < s.size(); i++) {
+            if (s[i] < '0' || s[i] > '9') {
+                return false;
+            }
+            v = v * 10 + (s[i] - '0');
+        }
+        out = v;
+        return true;
+    }
+
+    static bool startsBefore(const ByteRange& a, const ByteRange& b) {
+        return a.first < b.first;
+    }
+
+    RangeResult parseRange(const std::string& value, off_t size, std::vector<ByteRange>& ranges) {
+        ranges.clear();
+        std::string v = trim(value);
+        if (v.size() < 6 || v.compare(0, 6, "bytes=") != 0) {
+            return Whole;
+        }
+        size_t specs = 0;
+        size_t start = 6;
+        while (start <= v.size()) {
+            size_t comma = v.find(',', start);
+            if (comma == std::string::npos) {
+                comma = v.size();
+            }
+            std::string spec = trim(v.substr(start, comma - start));
+            start = comma + 1;
+            if (spec.empty()) {
+                continue;
+            }
+            if (++specs > MAX_RANGES) {
+                return Whole;
+            }
+            size_t dash = spec.find('-');
+            if (dash == std::string::npos) {
+                return Whole;
+            }
+            ByteRange r;
+            off_t first, last;
+            if (dash == 0) {
+                // Suffix: the last n bytes
+                if (!parseOffset(spec.substr(1), last)) {
+                    return Whole;
+                }
+                if (last == 0 || size == 0) {
+                    continue;
+                }
+                r.first = last < size ? size - last : 0;
+                r.last = size - 1;
+            } else {
+                if (!parseOffset(spec.substr(0, dash), first)) {
+                    return Whole;
+                }
+                if (dash + 1 == spec.size()) {
+                    last = size - 1;
+                } else if (!parseOffset(spec.substr(dash + 1), last) || last < first) {
+                    return Whole;
+                }
+                if (first >= size) {
+                    continue;
+                }
+                r.first = first;
+                r.last = last < size ? last : size - 1;
+            }
+            ranges.push_back(r);
+        }
+        if (specs == 0) {
+            return Whole;
+        }
+        // Overlapping and adjacent ranges are merged, so repeating one
+        // cannot make the body larger than the file
+        std::sort(ranges.begin(), ranges.end(), startsBefore);
+        size_t merged = 0;
+        for (size_t i = 1; i < ranges.size(); i++) {
+            if (ranges[i].first <= ranges[merged].last + 1) {
+                if (ranges[i].last > ranges[merged].last) {
+                    ranges[merged].last = ranges[i].last;
+                }
+            } else {
+                ranges[++merged] = ranges[i];
+            }
+        }
+        if (!ranges.empty()) {
+            ranges.resize(merged + 1);
+        }
+        return ranges.empty() ? Unsatisfiable : Partial;
+    }
+
+    static std::string toString(off_t n) {
+        std::ostringstream oss;
+        oss << n;
+        return oss.str();
+    }
+
+    static std::string contentRange(const ByteRange& r, off_t size) {
+        return "bytes " + toString(r.first) + "-" + toString(r.last) + "/" + toString(size);
+    }
+
+    // If-Range holds an ETag or a date; only an exact match keeps the Range
+    static bool ifRangeMatches(const Request& req, const Headers& h) {
+        std::string cond = trim(req.getHeaders().get("if-range"));
+        if (cond.empty()) {
+            return true;
+        }
+        if (cond[0] == '"') {
+            return cond == h.get("etag");
+        }
+        return cond == h.get("last-modified");
+    }
+
+    static const char* const CODING_NAMES[CODINGS] = {NULL, "br", "gzip"};
+    static const char* const CODING_SUFFIXES[CODINGS] = {NULL, ".br", ".gz"};
+
+    const char* codingName(Coding c) {
+        return CODING_NAMES[c];
+    }
+
+    const char* codingSuffix(Coding c) {
+        return CODING_SUFFIXES[c];
+    }
+
+    Coding negotiate(const std::string& acceptEncoding, unsigned available) {
+        if ((available & ~(1u << Identity)) == 0 || acceptEncoding.empty()) {
+            return Identity;
+        }
+        double identityQ = Response::encodingQuality(acceptEncoding, "identity");
+        Coding best = Identity;
+        double bestQ = identityQ < 0 ? 1 : identityQ;
+        for (int c = Identity + 1; c < CODINGS; c++) {
+            if (!(available & (1u << c))) {
+                continue;
+            }
+            double q = Response::encodingQuality(acceptEncoding, CODING_NAMES[c]);
+            // Codings come best first, so ties keep the earlier one, and
+            // any coding beats identity at the same q
+            if (q > 0 && (q > bestQ || (q == bestQ && best == Identity))) {
+                best = static_cast<Coding>(c);
+                bestQ = q;
+            }
+        }
+        return best;
+    }
+
+    int openRegular(const std::string& path, struct stat& st) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 && (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    static unsigned long nextBoundary = 0;
+
+    bool send(Response::Writer& w, const Request& req, int fd, off_t size, Headers h) {
+        h.replace("accept-ranges", "bytes");
+        std::vector<ByteRange> ranges;
+        RangeResult result = Whole;
+        HttpMethod::Method id = req.getMethodId();
+        if ((id == HttpMethod::Get || id == HttpMethod::Head) && ifRangeMatches(req, h)) {
+            result = parseRange(req.getHeaders().get("range"), size, ranges);
+        }
+
+        if (result == Unsatisfiable) {
+            h.replace("content-range", "bytes */" + toString(size));
+            h.replace("content-length", "0");
+            w.writeStatusLine(Response::StatusRangeNotSatisfiable);
+            w.writeHeaders(h);
+            return w.flush();
+        }
+        if (result == Whole) {
+            h.replace("content-length", toString(size));
+            w.writeStatusLine(Response::StatusOk);
+            w.writeHeaders(h);
+            return w.streamFile(fd, 0, static_cast<size_t>(size));
+        }
+        if (ranges.size() == 1) {
+            const ByteRange& r = ranges[0];
+            h.replace("content-range", contentRange(r, size));
+            h.replace("content-length", toString(r.last - r.first + 1));
+            w.writeStatusLine(Response::StatusPartialContent);
+            w.writeHeaders(h);
+            return w.streamFile(fd, r.first, static_cast<size_t>(r.last - r.first + 1));
+        }
+
+        // Each part is a header block and a file range; the headers are
+        // built first so Content-Length can cover the whole body
+        std::ostringstream boundary;
+        boundary << "httpfromtcp-" << std::hex << __sync_add_and_fetch(&nextBoundary, 1);
+        std::string type = h.get("content-type");
+        std::vector<std::string> parts;
+        off_t length = 0;
+        for (size_t i = 0; i < ranges.size(); i++) {
+            std::string part = "\r\n--" + boundary.str() + "\r\n";
+            if (!type.empty()) {
+                part += "content-type: " + type + "\r\n";
+            }
+            part += "content-range: " + contentRange(ranges[i], size) + "\r\n\r\n";
+            length += static_cast<off_t>(part.size()) + ranges[i].last - ranges[i].first + 1;
+            parts.push_back(part);
+        }
+        std::string closing = "\r\n--" + boundary.str() + "--\r\n";
+        length += static_cast<off_t>(closing.size());
+
+        h.replace("content-type", "multipart/byteranges; boundary=" + boundary.str());
+        h.replace("content-length", toString(length));
+        w.writeStatusLine(Response::StatusPartialContent);
+        w.writeHeaders(h);
+        for (size_t i = 0; i < ranges.size(); i++) {
+            if (!w.writeBody(parts[i].data(), parts[i].size()) ||
+                !w.streamFile(fd, ranges[i].first,
+                              static_cast<size_t>(ranges[i].last - ranges[i].first + 1))) {
+                return false;
+            }
+        }
+        return w.writeBody(closing.data(), closing.size());
+    }
+
+}
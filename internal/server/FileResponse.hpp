@@ -0,0 +1,68 @@
+#ifndef FILERESPONSE_HPP
+#define FILERESPONSE_HPP
+
+#include "Response.hpp"
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+class Request;
+
+// Byte ranges of a file-backed body, as asked for by Range
+namespace FileResponse {
+
+    // Inclusive, like the header
+    struct ByteRange {
+        off_t first;
+        off_t last;
+    };
+
+    enum RangeResult {
+        Whole,        // no usable Range: send everything
+        Partial,      // send ranges
+        Unsatisfiable // none of the ranges overlaps the body
+    };
+
+    // Most ranges honoured in one request; more get the whole body
+    const size_t MAX_RANGES = 16;
+
+    // Parses a Range value against a body of size bytes. Malformed values
+    // and units other than bytes are ignored. Ranges past the end are
+    // dropped and the rest clamped to the body, sorted, and merged where
+    // they overlap or touch.
+    RangeResult parseRange(const std::string& value, off_t size, std::vector<ByteRange>& ranges);
+
+    // Content codings a file may have precompressed next to it, as the
+    // file's name plus a suffix, e.g. "app.js.br"; best first
+    enum Coding {
+        Identity,
+        Brotli,
+        Gzip,
+        CODINGS
+    };
+
+    // Token for Content-Encoding; NULL for Identity
+    const char* codingName(Coding c);
+    // Suffix of the sidecar file; NULL for Identity
+    const char* codingSuffix(Coding c);
+
+    // Picks the coding to send from an Accept-Encoding value, among those
+    // with a bit (1 << coding) set in available. The highest q-value wins,
+    // then the earlier coding. Identity is always available and is sent
+    // when no other coding is acceptable.
+    Coding negotiate(const std::string& acceptEncoding, unsigned available);
+
+    // Opens a regular file read-only and stats it. -1 for anything else.
+    int openRegular(const std::string& path, struct stat& st);
+
+    // Sends size bytes of fd, from the event loop, with headers h: as 200,
+    // or for GET and HEAD with a Range as 206 with one range or a
+    // multipart/byteranges body, or 416. A Range is ignored if If-Range
+    // does not match h's ETag or Last-Modified. h should carry
+    // Content-Type; Content-Length and Accept-Ranges are set here.
+    bool send(Response::Writer& w, const Request& req, int fd, off_t size, Headers h);
+
+}
+
+#endif
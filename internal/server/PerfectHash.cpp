@@ -0,0 +1,143 @@
+#include "PerfectHash.hpp"
+#include <algorithm>
+#include <cstring>
+
+// Give up on a bucket after this many seeds
+static const uint32_t MAX_SEED = 1u << 20;
+// Average keys per bucket
+static const size_t BUCKET_LOAD = 4;
+
+// Eight bytes per multiply, so a path costs a handful of steps rather
+// than one per character
+uint64_t hashBytes(const char* data, size_t len) {
+    uint64_t h = 14695981039346656037ull ^ (len * 0x9e3779b97f4a7c15ull);
+    while (len >= 8) {
+        uint64_t w;
+        std::memcpy(&w, data, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 29;
+        data += 8;
+        len -= 8;
+    }
+    if (len > 0) {
+        uint64_t w = 0;
+        for (size_t i = 0; i < len; i++) {
+            w |= static_cast<uint64_t>(static_cast<unsigned char>(data[i])) << (8 * i);
+        }
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 29;
+    }
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 32;
+    return h;
+}
+
+// Maps 32 hash bits onto [0, n) with a multiply instead of a division
+static size_t reduce(uint32_t x, size_t n) {
+    return static_cast<size_t>((static_cast<uint64_t>(x) * n) >> 32);
+}
+
+size_t PerfectHash::bucketOf(uint64_t h) const {
+    return reduce(static_cast<uint32_t>(h >> 32), seeds.size());
+}
+
+// Each seed gives an unrelated slot for the same key hash
+size_t PerfectHash::slotOf(uint64_t h, uint32_t seed) const {
+    h ^= seed * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return reduce(static_cast<uint32_t>(h), slots.size());
+}
+
+PerfectHash::PerfectHash() {}
+
+// Orders buckets largest first; they are the hardest to place
+struct BySize {
+    const std::vector<std::vector<size_t> >* buckets;
+    bool operator()(size_t a, size_t b) const {
+        return (*buckets)[a].size() > (*buckets)[b].size();
+    }
+};
+
+bool PerfectHash::build(const std::vector<std::string>& k) {
+    keys = k;
+    size_t n = keys.size();
+    Slot empty;
+    empty.hash = 0;
+    empty.key = -1;
+    slots.assign(n, empty);
+    lengths.assign(0, false);
+    for (size_t i = 0; i < n; i++) {
+        if (keys[i].size() >= lengths.size()) {
+            lengths.resize(keys[i].size() + 1, false);
+        }
+        lengths[keys[i].size()] = true;
+    }
+    seeds.assign(n / BUCKET_LOAD + 1, 0);
+    if (n == 0) {
+        return true;
+    }
+
+    std::vector<uint64_t> hashes(n);
+    std::vector<std::vector<size_t> > buckets(seeds.size());
+    for (size_t i = 0; i < n; i++) {
+        hashes[i] = hashBytes(keys[i].data(), keys[i].size());
+        buckets[bucketOf(hashes[i])].push_back(i);
+    }
+    std::vector<size_t> order(buckets.size());
+    for (size_t b = 0; b < order.size(); b++) {
+        order[b] = b;
+    }
+    BySize bySize;
+    bySize.buckets = &buckets;
+    std::sort(order.begin(), order.end(), bySize);
+
+    std::vector<size_t> placed;
+    for (size_t o = 0; o < order.size() && !buckets[order[o]].empty(); o++) {
+        const std::vector<size_t>& bucket = buckets[order[o]];
+        uint32_t seed = 1;
+        for (; seed < MAX_SEED; seed++) {
+            placed.clear();
+            size_t j = 0;
+            for (; j < bucket.size(); j++) {
+                size_t slot = slotOf(hashes[bucket[j]], seed);
+                if (slots[slot].key >= 0) {
+                    break;
+                }
+                slots[slot].hash = hashes[bucket[j]];
+                slots[slot].key = static_cast<int>(bucket[j]);
+                placed.push_back(slot);
+            }
+            if (j == bucket.size()) {
+                break;
+            }
+            for (size_t p = 0; p < placed.size(); p++) {
+                slots[placed[p]].key = -1;
+            }
+        }
+        if (seed == MAX_SEED) {
+            return false;
+        }
+        seeds[order[o]] = seed;
+    }
+    return true;
+}
+
+int PerfectHash::find(const char* key, size_t len) const {
+    // No key has this length, so there is nothing to hash for
+    if (len >= lengths.size() || !lengths[len]) {
+        return -1;
+    }
+    uint64_t h = hashBytes(key, len);
+    const Slot& s = slots[slotOf(h, seeds[bucketOf(h)])];
+    // Most misses stop at the hash, before touching the key
+    if (s.hash != h) {
+        return -1;
+    }
+    const std::string& k = keys[s.key];
+    if (k.size() != len || std::memcmp(k.data(), key, len) != 0) {
+        return -1;
+    }
+    return s.key;
+}
@@ -0,0 +1,44 @@
+#ifndef PERFECTHASH_HPP
+#define PERFECTHASH_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// 64-bit hash of path-like keys, taken a word at a time
+uint64_t hashBytes(const char* data, size_t len);
+
+// Minimal perfect hash over a fixed key set, built by hash-and-displace:
+// keys are grouped into buckets by one hash, then each bucket gets a seed
+// that places all its keys in free slots of an n-slot table. A lookup
+// hashes the key once, remixes the hash with its bucket's seed and
+// compares the slot's stored hash, then one key. Keys of a length no key
+// has are turned away before hashing.
+class PerfectHash {
+public:
+    PerfectHash();
+
+    // Keys must be unique. False if no placement was found.
+    bool build(const std::vector<std::string>& keys);
+
+    // Index of key in the vector passed to build, or -1
+    int find(const char* key, size_t len) const;
+    size_t size() const { return keys.size(); }
+
+private:
+    struct Slot {
+        uint64_t hash; // of the key, to reject misses without comparing
+        int key;       // index into keys, -1 while building
+    };
+
+    std::vector<std::string> keys;
+    std::vector<uint32_t> seeds; // per bucket
+    std::vector<Slot> slots;
+    std::vector<bool> lengths; // by key length, true if some key has it
+
+    size_t bucketOf(uint64_t h) const;
+    size_t slotOf(uint64_t h, uint32_t seed) const;
+};
+
+#endif
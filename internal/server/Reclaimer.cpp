@@ -0,0 +1,133 @@
+#include "Reclaimer.hpp"
+
+// The calling thread's slots in the reclaimers it used last
+static const int CACHED_SLOTS = 4;
+static __thread const Reclaimer* cachedOwner[CACHED_SLOTS];
+static __thread void* cachedReader[CACHED_SLOTS];
+static __thread int cachedNext;
+
+Reclaimer::Reclaimer() : epoch(1), readerCount(0), overflow(0), pendingCount(0) {
+    for (int i = 0; i < MAX_READERS; i++) {
+        readers[i].claimed = 0;
+        readers[i].epoch = 0;
+    }
+    pthread_mutex_init(&retireLock, NULL);
+}
+
+Reclaimer::~Reclaimer() {
+    for (size_t i = 0; i < retired.size(); i++) {
+        retired[i].del(retired[i].obj);
+    }
+    pthread_mutex_destroy(&retireLock);
+}
+
+// Slots are claimed on first use and kept for the thread's lifetime
+Reclaimer::Reader* Reclaimer::reader() {
+    pthread_t self = pthread_self();
+    for (int i = 0; i < CACHED_SLOTS; i++) {
+        if (cachedOwner[i] == this) {
+            // A reclaimer at a reused address does not have this slot claimed
+            Reader* r = static_cast<Reader*>(cachedReader[i]);
+            if (r->claimed && pthread_equal(r->owner, self)) {
+                return r;
+            }
+        }
+    }
+    int n = readerCount < MAX_READERS ? readerCount : MAX_READERS;
+    Reader* r = NULL;
+    for (int i = 0; i < n && r == NULL; i++) {
+        if (readers[i].claimed && pthread_equal(readers[i].owner, self)) {
+            r = &readers[i];
+        }
+    }
+    if (r == NULL) {
+        int i = __sync_fetch_and_add(&readerCount, 1);
+        if (i >= MAX_READERS) {
+            overflow = 1;
+            return NULL;
+        }
+        r = &readers[i];
+        r->owner = self;
+        __sync_synchronize();
+        r->claimed = 1;
+    }
+    cachedOwner[cachedNext] = this;
+    cachedReader[cachedNext] = r;
+    cachedNext = (cachedNext + 1) % CACHED_SLOTS;
+    return r;
+}
+
+void Reclaimer::enter() {
+    Reader* r = reader();
+    if (r != NULL && r->epoch == 0) {
+        // Going online must be visible before shared pointers are read,
+        // so a writer either sees this reader or this reader sees its swap
+        r->epoch = epoch;
+        __sync_synchronize();
+    }
+}
+
+void Reclaimer::quiescent() {
+    Reader* r = reader();
+    if (r == NULL) {
+        return;
+    }
+    __sync_synchronize();
+    r->epoch = epoch;
+    __sync_synchronize();
+    if (pendingCount > 0 && pthread_mutex_trylock(&retireLock) == 0) {
+        reclaimLocked();
+        pthread_mutex_unlock(&retireLock);
+    }
+}
+
+void Reclaimer::offline() {
+    Reader* r = reader();
+    if (r != NULL) {
+        __sync_synchronize();
+        r->epoch = 0;
+    }
+}
+
+void Reclaimer::retire(void* obj, Deleter del) {
+    pthread_mutex_lock(&retireLock);
+    __sync_synchronize();
+    Retired r;
+    r.obj = obj;
+    r.del = del;
+    r.epoch = __sync_add_and_fetch(&epoch, 1);
+    retired.push_back(r);
+    reclaimLocked();
+    pthread_mutex_unlock(&retireLock);
+}
+
+void Reclaimer::reclaim() {
+    pthread_mutex_lock(&retireLock);
+    reclaimLocked();
+    pthread_mutex_unlock(&retireLock);
+}
+
+void Reclaimer::reclaimLocked() {
+    if (!overflow) {
+        __sync_synchronize();
+        // The oldest epoch an online reader may still be in
+        unsigned long oldest = epoch;
+        int n = readerCount < MAX_READERS ? readerCount : MAX_READERS;
+        for (int i = 0; i < n; i++) {
+            unsigned long seen = readers[i].epoch;
+            if (readers[i].claimed && seen != 0 && seen < oldest) {
+                oldest = seen;
+            }
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < retired.size(); i++) {
+            if (retired[i].epoch <= oldest) {
+                retired[i].del(retired[i].obj);
+            } else {
+                retired[kept++] = retired[i];
+            }
+        }
+        retired.resize(kept);
+    }
+    pendingCount = retired.size();
+}
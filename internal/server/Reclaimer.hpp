@@ -0,0 +1,70 @@
+#ifndef RECLAIMER_HPP
+#define RECLAIMER_HPP
+
+#include <pthread.h>
+#include <cstddef>
+#include <vector>
+
+// Deferred deletion for data read without locks. Each reading thread is
+// online while it may hold pointers to shared objects and offline or at
+// a quiescent point when it holds none. A retired object is deleted once
+// every thread that was online when it was retired has since gone
+// offline or passed a quiescent point.
+//
+// Loop threads can stay online across requests and call quiescent()
+// between them; short readers can bracket each read with enter() and
+// offline().
+class Reclaimer {
+public:
+    // Threads beyond this many still read, but retired objects are then
+    // kept until the reclaimer is destroyed
+    static const int MAX_READERS = 64;
+
+    typedef void (*Deleter)(void* obj);
+
+    Reclaimer();
+    // Deletes everything still retired
+    ~Reclaimer();
+
+    // Marks the calling thread online. Shared pointers must be loaded
+    // after this.
+    void enter();
+    void quiescent();
+    void offline();
+
+    // Deletes obj with del once no reader can still see it. obj must
+    // already be unreachable for new readers.
+    void retire(void* obj, Deleter del);
+    void reclaim();
+    size_t pending() const { return pendingCount; }
+
+private:
+    struct Reader {
+        pthread_t owner;
+        int claimed;
+        volatile unsigned long epoch; // last epoch seen, 0 while offline
+    };
+
+    struct Retired {
+        void* obj;
+        Deleter del;
+        unsigned long epoch; // readers at or past this cannot see obj
+    };
+
+    volatile unsigned long epoch;
+    Reader readers[MAX_READERS];
+    volatile int readerCount;
+    volatile int overflow; // a thread went untracked
+
+    pthread_mutex_t retireLock; // writers only
+    std::vector<Retired> retired;
+    volatile size_t pendingCount;
+
+    Reclaimer(const Reclaimer&);
+    Reclaimer& operator=(const Reclaimer&);
+
+    Reader* reader();
+    void reclaimLocked();
+};
+
+#endif
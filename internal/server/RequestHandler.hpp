@@ -8,6 +8,12 @@ class Request;
 class RequestHandler {
 public:
     virtual void handle(Response::Writer& w, const Request& req) = 0;
+    // Called by a loop thread between requests, when it holds nothing
+    // from earlier handle() calls
+    virtual void quiescent() {}
+    // Called before the loop thread blocks; it is quiescent until its
+    // next handle() or quiescent()
+    virtual void offline() {}
     virtual ~RequestHandler() {}
 };
 
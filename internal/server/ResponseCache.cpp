@@ -0,0 +1,305 @@
+#include "ResponseCache.hpp"
+#include "PerfectHash.hpp"
+#include "Util.hpp"
+#include <algorithm>
+
+ResponseCache::ResponseCache(size_t maxBytes, size_t n)
+    : mask(1), maxBytes(maxBytes), used(0), count(0) {
+    while (mask < n) {
+        mask <<= 1;
+    }
+    buckets = new Entry* volatile[mask];
+    for (size_t i = 0; i < mask; i++) {
+        buckets[i] = NULL;
+    }
+    mask--;
+    pthread_mutex_init(&writeLock, NULL);
+}
+
+ResponseCache::~ResponseCache() {
+    for (size_t i = 0; i <= mask; i++) {
+        deleteChain(buckets[i]);
+    }
+    delete[] buckets;
+    pthread_mutex_destroy(&writeLock);
+}
+
+void ResponseCache::deleteChain(void* head) {
+    Entry* e = static_cast<Entry*>(head);
+    while (e != NULL) {
+        Entry* next = e->next;
+        delete e;
+        e = next;
+    }
+}
+
+// "GET /a?b=1&a=2" and "GET /a?a=2&b=1" share an entry. The normalized
+// Host keeps the sites of a wildcard virtual host apart.
+std::string ResponseCache::makeKey(const Request& req) {
+    std::string key = req.getMethod();
+    key += ' ';
+    key += req.getHost();
+    StringView path = req.getPath();
+    key.append(path.data(), path.size());
+    StringView query = req.getQuery();
+    if (query.empty()) {
+        return key;
+    }
+    std::vector<std::string> pairs;
+    Query::Iterator it(query);
+    StringView name, value;
+    while (it.next(name, value)) {
+        pairs.push_back(name.str() + "=" + value.str());
+    }
+    std::sort(pairs.begin(), pairs.end());
+    for (size_t i = 0; i < pairs.size(); i++) {
+        key += i == 0 ? '?' : '&';
+        key += pairs[i];
+    }
+    return key;
+}
+
+std::string ResponseCache::varyValues(const std::string& vary, const Request& req) {
+    std::string values;
+    size_t start = 0;
+    while (start < vary.size()) {
+        size_t comma = vary.find(',', start);
+        if (comma == std::string::npos) {
+            comma = vary.size();
+        }
+        size_t b = start;
+        size_t e = comma;
+        while (b < e && vary[b] == ' ') {
+            b++;
+        }
+        while (e > b && vary[e - 1] == ' ') {
+            e--;
+        }
+        if (e > b) {
+            values += req.getHeaders().get(vary.substr(b, e - b));
+            values += '\n';
+        }
+        start = comma + 1;
+    }
+    return values;
+}
+
+size_t ResponseCache::bucketOf(const std::string& key) const {
+    return static_cast<size_t>(hashBytes(key.data(), key.size())) & mask;
+}
+
+ResponseCache::Entry* ResponseCache::find(size_t b, const std::string& key, const Request& req) const {
+    for (Entry* e = buckets[b]; e != NULL; e = e->next) {
+        if (e->key == key && (e->vary.empty() || e->varyValues == varyValues(e->vary, req))) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+ResponseCache::State ResponseCache::lookup(const Request& req, long nowMs, Hit& hit) {
+    std::string key = makeKey(req);
+    size_t b = bucketOf(key);
+    State state = Miss;
+    hit.revalidate = false;
+    bool unclaimed = false;
+
+    readers.enter();
+    Entry* e = find(b, key, req);
+    if (e != NULL && nowMs < e->staleUntil) {
+        hit.data = e->data;
+        hit.slot = e->slot;
+        e->lastUsed = nowMs;
+        state = nowMs < e->expiresAt ? Fresh : Stale;
+        unclaimed = state == Stale && e->revalidating == 0;
+    }
+    readers.offline();
+
+    // Claims are made on the current chain under the lock, so a copy made
+    // by a concurrent rebuild cannot hand out a second one
+    if (unclaimed) {
+        pthread_mutex_lock(&writeLock);
+        e = find(b, key, req);
+        if (e != NULL && nowMs >= e->expiresAt && nowMs < e->staleUntil && e->revalidating == 0) {
+            e->revalidating = 1;
+            hit.revalidate = true;
+        }
+        pthread_mutex_unlock(&writeLock);
+    }
+    return state;
+}
+
+void ResponseCache::abandon(const Request& req) {
+    std::string key = makeKey(req);
+    pthread_mutex_lock(&writeLock);
+    Entry* e = find(bucketOf(key), key, req);
+    if (e != NULL) {
+        e->revalidating = 0;
+    }
+    pthread_mutex_unlock(&writeLock);
+}
+
+// The value of a header in a serialized header block, whose names are
+// lowercase. False if it is absent.
+static bool headerValue(const std::string& head, const char* name, std::string& value) {
+    std::string needle = std::string("\r\n") + name + ": ";
+    size_t at = head.find(needle);
+    if (at == std::string::npos) {
+        return false;
+    }
+    at += needle.size();
+    value = head.substr(at, head.find("\r\n", at) - at);
+    return true;
+}
+
+bool ResponseCache::store(const Request& req, const std::string& response, size_t slot,
+                          long nowMs, long ttlMs, long staleMs) {
+    size_t headEnd = response.find("\r\n\r\n");
+    if (response.compare(0, 13, "HTTP/1.1 200 ") != 0 || headEnd == std::string::npos) {
+        return false;
+    }
+    std::string head = response.substr(0, headEnd + 2);
+    std::string value;
+    if (headerValue(head, "set-cookie", value)) {
+        return false;
+    }
+    if (headerValue(head, "cache-control", value) &&
+        (value.find("no-store") != std::string::npos || value.find("no-cache") != std::string::npos ||
+         value.find("private") != std::string::npos)) {
+        return false;
+    }
+
+    Entry* e = new Entry;
+    e->key = makeKey(req);
+    if (headerValue(head, "vary", e->vary)) {
+        if (e->vary.find('*') != std::string::npos) {
+            delete e;
+            return false;
+        }
+        for (size_t i = 0; i < e->vary.size(); i++) {
+            if (e->vary[i] >= 'A' && e->vary[i] <= 'Z') {
+                e->vary[i] = static_cast<char>(e->vary[i] - 'A' + 'a');
+            }
+        }
+        e->varyValues = varyValues(e->vary, req);
+    }
+    e->data = Response::Buffer(response.data(), response.size());
+    e->slot = slot;
+    e->expiresAt = nowMs + ttlMs;
+    e->staleUntil = e->expiresAt + staleMs;
+    e->lastUsed = nowMs;
+    e->revalidating = 0;
+    e->next = NULL;
+    if (e->cost() > maxBytes) {
+        delete e;
+        return false;
+    }
+
+    pthread_mutex_lock(&writeLock);
+    rebuild(bucketOf(e->key), e, NULL, nowMs);
+    evict(nowMs);
+    pthread_mutex_unlock(&writeLock);
+    return true;
+}
+
+void ResponseCache::rebuild(size_t b, Entry* add, const Entry* victim, long nowMs) {
+    Entry* old = buckets[b];
+    Entry* head = add;
+    Entry** tail = add != NULL ? &add->next : &head;
+    for (Entry* e = old; e != NULL; e = e->next) {
+        bool replaced = add != NULL && e->key == add->key && e->varyValues == add->varyValues;
+        if (e == victim || replaced || nowMs >= e->staleUntil) {
+            used -= e->cost();
+            count--;
+            continue;
+        }
+        Entry* copy = new Entry;
+        copy->key = e->key;
+        copy->vary = e->vary;
+        copy->varyValues = e->varyValues;
+        copy->data = e->data;
+        copy->slot = e->slot;
+        copy->expiresAt = e->expiresAt;
+        copy->staleUntil = e->staleUntil;
+        copy->lastUsed = e->lastUsed;
+        copy->revalidating = e->revalidating;
+        copy->next = NULL;
+        *tail = copy;
+        tail = &copy->next;
+    }
+    if (add != NULL) {
+        used += add->cost();
+        count++;
+    }
+    // Entries must be complete before readers can reach them
+    __sync_synchronize();
+    buckets[b] = head;
+    if (old != NULL) {
+        readers.retire(old, deleteChain);
+    }
+}
+
+// Drops the least recently used entries until the cache fits. A full
+// scan per eviction keeps lookups free of any shared LRU list.
+void ResponseCache::evict(long nowMs) {
+    while (used > maxBytes) {
+        const Entry* oldest = NULL;
+        size_t where = 0;
+        for (size_t b = 0; b <= mask; b++) {
+            for (const Entry* e = buckets[b]; e != NULL; e = e->next) {
+                if (oldest == NULL || e->lastUsed < oldest->lastUsed) {
+                    oldest = e;
+                    where = b;
+                }
+            }
+        }
+        if (oldest == NULL) {
+            return;
+        }
+        rebuild(where, NULL, oldest, nowMs);
+    }
+}
+
+CachedRoute::CachedRoute(RouteHandler& inner, ResponseCache& cache, long ttlMs, long staleMs)
+    : inner(inner), cache(cache), ttlMs(ttlMs), staleMs(staleMs) {}
+
+void CachedRoute::handle(Response::Writer& w, const Request& req) {
+    HttpMethod::Method id = req.getMethodId();
+    if (id != HttpMethod::Get && id != HttpMethod::Head) {
+        inner.handle(w, req);
+        return;
+    }
+
+    ResponseCache::Hit hit;
+    ResponseCache::State state = cache.lookup(req, monotonicMs(), hit);
+    if (state != ResponseCache::Miss) {
+        w.writeSerialized(hit.data, hit.slot);
+        if (state == ResponseCache::Stale && hit.revalidate) {
+            // The client already has its answer; refresh into a writer
+            // that only captures
+            std::string fresh;
+            Response::Writer shadow(-1);
+            if (id == HttpMethod::Head) {
+                shadow.suppressBody();
+            }
+            shadow.capture(&fresh);
+            inner.handle(shadow, req);
+            shadow.flush();
+            // A refresh that cannot be kept lets the next stale hit try
+            if (!shadow.captured() ||
+                !cache.store(req, fresh, shadow.captureSlot(), monotonicMs(), ttlMs, staleMs)) {
+                cache.abandon(req);
+            }
+        }
+        return;
+    }
+
+    std::string response;
+    w.capture(&response);
+    inner.handle(w, req);
+    // Streamed responses are left to the loop
+    if (w.captured() && w.flush()) {
+        cache.store(req, response, w.captureSlot(), monotonicMs(), ttlMs, staleMs);
+    }
+    w.capture(NULL);
+}
@@ -0,0 +1,103 @@
+#ifndef RESPONSECACHE_HPP
+#define RESPONSECACHE_HPP
+
+#include "Router.hpp"
+#include "Reclaimer.hpp"
+#include <string>
+
+// Complete serialized responses kept in memory, keyed by method, Host and
+// target, with the query's parameters sorted, plus the values of the
+// request headers the response names in Vary. Only 200 responses
+// without Set-Cookie or a no-store, no-cache or private Cache-Control are
+// kept.
+//
+// Each entry is fresh for its TTL and may then be served stale for a
+// while longer, during which one request gets to refresh it. The cache
+// is bounded in bytes; the least recently used entries go first.
+//
+// Lookups take no lock: buckets are chains of immutable entries that
+// writers replace as a whole, retiring the old chain to a Reclaimer. Only
+// the refresh claim on a stale entry is set in place, under the writer
+// lock, and only a stale hit that finds it unclaimed takes that lock.
+class ResponseCache {
+public:
+    enum State {
+        Miss,
+        Fresh,
+        Stale
+    };
+
+    struct Hit {
+        Response::Buffer data; // without Date and Server lines
+        size_t slot;           // where they go
+        bool revalidate;       // this caller should refresh a stale entry
+    };
+
+    explicit ResponseCache(size_t maxBytes, size_t buckets = 1024);
+    ~ResponseCache();
+
+    State lookup(const Request& req, long nowMs, Hit& hit);
+    // Gives up a refresh claimed by lookup that was not stored, so a later
+    // stale hit refreshes instead
+    void abandon(const Request& req);
+    // Keeps a response captured for req if it may be cached. False if it
+    // was not kept.
+    bool store(const Request& req, const std::string& response, size_t slot,
+               long nowMs, long ttlMs, long staleMs);
+
+    size_t bytes() const { return used; }
+    size_t entries() const { return count; }
+
+private:
+    struct Entry {
+        std::string key;
+        std::string vary;       // request header names from Vary
+        std::string varyValues; // their values when stored
+        Response::Buffer data;
+        size_t slot;
+        long expiresAt;
+        long staleUntil;
+        volatile long lastUsed;
+        volatile int revalidating; // set and cleared under writeLock
+        Entry* next;
+
+        size_t cost() const { return key.size() + data.size(); }
+    };
+
+    Entry* volatile* buckets;
+    size_t mask;
+    size_t maxBytes;
+    size_t used;
+    size_t count;
+    pthread_mutex_t writeLock;
+    Reclaimer readers;
+
+    ResponseCache(const ResponseCache&);
+    ResponseCache& operator=(const ResponseCache&);
+
+    static std::string makeKey(const Request& req);
+    static std::string varyValues(const std::string& vary, const Request& req);
+    static void deleteChain(void* head);
+    size_t bucketOf(const std::string& key) const;
+    Entry* find(size_t b, const std::string& key, const Request& req) const;
+    // Replaces bucket b's chain with add, if any, followed by copies of
+    // the entries it does not replace, except victim and expired ones
+    void rebuild(size_t b, Entry* add, const Entry* victim, long nowMs);
+    void evict(long nowMs);
+};
+
+// Serves a route from a ResponseCache, running the wrapped handler on
+// misses and to refresh stale entries. Only GET and HEAD are cached.
+class CachedRoute : public RouteHandler {
+public:
+    CachedRoute(RouteHandler& inner, ResponseCache& cache, long ttlMs, long staleMs);
+    void handle(Response::Writer& w, const Request& req);
+
+private:
+    RouteHandler& inner;
+    ResponseCache& cache;
+    long ttlMs;
+    long staleMs;
+};
+
+#endif
@@ -0,0 +1,52 @@
+#include "RouteTable.hpp"
+
+static void deleteRouter(void* router) {
+    delete static_cast<Router*>(router);
+}
+
+RouteTable::RouteTable() : current(NULL) {
+    pthread_mutex_init(&publishLock, NULL);
+}
+
+RouteTable::~RouteTable() {
+    delete current;
+    pthread_mutex_destroy(&publishLock);
+}
+
+Router* RouteTable::snapshot() {
+    readers.enter();
+    return current;
+}
+
+void RouteTable::handle(Response::Writer& w, const Request& req) {
+    Router* router = snapshot();
+    if (router == NULL) {
+        w.writeStatusLine(Response::StatusInternalServerError);
+        w.writeHeaders(Response::getDefaultHeaders(0));
+        w.flush();
+        return;
+    }
+    router->handle(w, req);
+}
+
+void RouteTable::quiescent() {
+    readers.quiescent();
+}
+
+void RouteTable::offline() {
+    readers.offline();
+}
+
+bool RouteTable::publish(Router* router) {
+    if (router == NULL || !router->isFrozen()) {
+        return false;
+    }
+    pthread_mutex_lock(&publishLock);
+    Router* old = current;
+    current = router;
+    pthread_mutex_unlock(&publishLock);
+    if (old != NULL) {
+        readers.retire(old, deleteRouter);
+    }
+    return true;
+}
@@ -0,0 +1,42 @@
+#ifndef ROUTETABLE_HPP
+#define ROUTETABLE_HPP
+
+#include "Router.hpp"
+#include "Reclaimer.hpp"
+
+// Serves requests from the current frozen Router and lets another thread
+// swap in a new one without stopping the server. Readers take no lock:
+// each loop thread announces quiescent points, where it holds nothing
+// from earlier requests, and a replaced Router is deleted once every
+// thread has passed one since it was retired.
+class RouteTable : public RequestHandler {
+public:
+    RouteTable();
+    ~RouteTable();
+
+    // Makes router current and takes ownership of it. False, without
+    // taking ownership, if it is NULL or not frozen.
+    bool publish(Router* router);
+
+    // The current router; valid on the calling thread until its next
+    // quiescent point. NULL before the first publish.
+    Router* snapshot();
+
+    void handle(Response::Writer& w, const Request& req);
+    void quiescent();
+    void offline();
+
+    // Deletes retired routers no reader can still see
+    void reclaim() { readers.reclaim(); }
+    size_t retiredCount() const { return readers.pending(); }
+
+private:
+    Router* volatile current;
+    pthread_mutex_t publishLock;
+    Reclaimer readers;
+
+    RouteTable(const RouteTable&);
+    RouteTable& operator=(const RouteTable&);
+};
+
+#endif
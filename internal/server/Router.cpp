@@ -1,9 +1,21 @@
 #include "Router.hpp"
 #include "Request.hpp"
+#include "ResponseCache.hpp"
+#include <algorithm>
+#include <cstring>
+#include <ctime>
 
-Router::Router() : defaultHandler(NULL) {}
+Router::Node::~Node() {
+    for (size_t i = 0; i < children.size(); i++) {
+        delete children[i];
+    }
+    delete param;
+}
+
+Router::Router() : profiling(false), root(new Node), defaultHandler(NULL), frozen(false) {}
 
 Router::~Router() {
+    delete root;
     for (size_t i = 0; i < owned.size(); i++) {
         delete owned[i];
     }
@@ -15,74 +27,680 @@ RouteHandler* Router::wrap(HandlerFunc f) {
     return h;
 }
 
-void Router::use(MiddlewareFunc mw) {
-    middlewares.push_back(mw);
+// Prepared bodies at least this large skip the copy into the kernel;
+// below it, page pinning and completion tracking cost more than the copy
+static const size_t ZEROCOPY_MIN = 64 * 1024;
+
+// Serves the cached variant in the best coding the client accepts
+void Router::PreparedHandler::handle(Response::Writer& w, const Request& req) {
+    Response::Encoding e = Response::negotiateEncoding(req.getHeaders().get("accept-encoding"));
+    w.setEncoding(e);
+    if (response.variant(e).data().size() >= ZEROCOPY_MIN) {
+        w.setZeroCopy(ZEROCOPY_MIN);
+    }
+    w.writePrepared(response);
 }
 
-void Router::get(const std::string& path, HandlerFunc handler) {
-    get(path, *wrap(handler));
+RouteHandler* Router::wrap(const Response::Prepared& response) {
+    PreparedHandler* h = new PreparedHandler(response);
+    owned.push_back(h);
+    return h;
 }
 
-void Router::get(const std::string& path, RouteHandler& handler) {
-    Route r;
-    r.method = "GET";
-    r.path = path;
-    r.isPrefix = false;
-    r.handler = &handler;
-    routes.push_back(r);
+size_t Router::addStage(MiddlewareFunc mw, const char* name, const std::string& path) {
+    Stage st;
+    st.func = mw;
+    st.name = name != NULL ? name : "";
+    st.path = path;
+    st.calls = 0;
+    st.nanos = 0;
+    stages.push_back(st);
+    return stages.size() - 1;
 }
 
-void Router::prefix(const std::string& pathPrefix, HandlerFunc handler) {
-    prefix(pathPrefix, *wrap(handler));
+bool Router::use(MiddlewareFunc mw, const char* name) {
+    if (frozen) {
+        return false;
+    }
+    globalStages.push_back(addStage(mw, name, ""));
+    return true;
 }
 
-void Router::prefix(const std::string& pathPrefix, RouteHandler& handler) {
-    Route r;
-    r.method = "";
-    r.path = pathPrefix;
-    r.isPrefix = true;
-    r.handler = &handler;
-    routes.push_back(r);
+// "/a/b" is {"a", "b"} and "/" is {""}. Prefixes drop a trailing empty
+// segment, so "/a/" and "/a" name the same subtree and "/" is the root.
+static std::vector<std::string> splitPath(const std::string& path, bool isPrefix) {
+    std::vector<std::string> segments;
+    size_t start = (!path.empty() && path[0] == '/') ? 1 : 0;
+    for (;;) {
+        size_t slash = path.find('/', start);
+        if (slash == std::string::npos) {
+            segments.push_back(path.substr(start));
+            break;
+        }
+        segments.push_back(path.substr(start, slash - start));
+        start = slash + 1;
+    }
+    if (isPrefix && segments.back().empty()) {
+        segments.pop_back();
+    }
+    return segments;
 }
 
-void Router::setDefault(HandlerFunc handler) {
-    setDefault(*wrap(handler));
+static bool isParam(const std::string& segment) {
+    return segment.size() > 1 && segment[0] == ':';
 }
 
-void Router::setDefault(RouteHandler& handler) {
+static int compareSegment(const std::string& label, const char* seg, size_t len) {
+    size_t n = label.size() < len ? label.size() : len;
+    int c = std::memcmp(label.data(), seg, n);
+    if (c != 0) {
+        return c;
+    }
+    return label.size() < len ? -1 : (label.size() > len ? 1 : 0);
+}
+
+// Index of the first child whose first segment is not less than seg
+size_t Router::lowerBound(const std::vector<Node*>& children, const char* seg, size_t len) {
+    size_t lo = 0;
+    size_t hi = children.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (compareSegment(children[mid]->label[0], seg, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+Router::Node* Router::findChild(const Node* n, const char* seg, size_t len) {
+    size_t i = lowerBound(n->children, seg, len);
+    if (i < n->children.size() && compareSegment(n->children[i]->label[0], seg, len) == 0) {
+        return n->children[i];
+    }
+    return NULL;
+}
+
+Router::Node* Router::insert(const std::vector<std::string>& segments) {
+    Node* n = root;
+    size_t i = 0;
+    while (i < segments.size()) {
+        const std::string& seg = segments[i];
+        if (isParam(seg)) {
+            // One parameter child per node; the first name registered wins
+            if (n->param == NULL) {
+                n->param = new Node;
+                n->param->label.push_back(seg);
+                n->param->paramName = seg.substr(1);
+            }
+            n = n->param;
+            i++;
+            continue;
+        }
+
+        Node* c = findChild(n, seg.data(), seg.size());
+        if (c == NULL) {
+            // Static segments up to the next parameter share one node
+            size_t j = i + 1;
+            while (j < segments.size() && !isParam(segments[j])) {
+                j++;
+            }
+            c = new Node;
+            c->label.assign(segments.begin() + i, segments.begin() + j);
+            n->children.insert(n->children.begin() + lowerBound(n->children, seg.data(), seg.size()), c);
+            n = c;
+            i = j;
+            continue;
+        }
+
+        size_t k = 1;
+        while (k < c->label.size() && i + k < segments.size() && c->label[k] == segments[i + k]) {
+            k++;
+        }
+        if (k < c->label.size()) {
+            // Split: c keeps the shared segments, the rest moves to a child
+            Node* tail = new Node;
+            tail->label.assign(c->label.begin() + k, c->label.end());
+            tail->children.swap(c->children);
+            tail->param = c->param;
+            c->param = NULL;
+            std::swap(tail->exact, c->exact);
+            std::swap(tail->prefix, c->prefix);
+            tail->routeStages.swap(c->routeStages);
+            tail->subtreeStages.swap(c->subtreeStages);
+            c->label.resize(k);
+            c->children.push_back(tail);
+        }
+        n = c;
+        i += k;
+    }
+    return n;
+}
+
+Router::Node* Router::lookupNode(const std::vector<std::string>& segments) const {
+    Node* n = root;
+    size_t i = 0;
+    while (i < segments.size()) {
+        if (isParam(segments[i])) {
+            if (n->param == NULL) {
+                return NULL;
+            }
+            n = n->param;
+            i++;
+            continue;
+        }
+        Node* c = findChild(n, segments[i].data(), segments[i].size());
+        if (c == NULL || i + c->label.size() > segments.size()) {
+            return NULL;
+        }
+        for (size_t k = 0; k < c->label.size(); k++) {
+            if (c->label[k] != segments[i + k]) {
+                return NULL;
+            }
+        }
+        n = c;
+        i += c->label.size();
+    }
+    return n;
+}
+
+bool Router::add(bool isPrefix, const std::string& path, const std::string& method,
+                 RouteHandler& handler) {
+    if (frozen) {
+        return false;
+    }
+    std::vector<std::string> segments = splitPath(path, isPrefix);
+    if (!segments.empty() && segments.back() == "*") {
+        segments.pop_back();
+        isPrefix = true;
+    }
+    Node* n = insert(segments);
+    Endpoint& e = isPrefix ? n->prefix : n->exact;
+
+    Route* r = &e.any;
+    HttpMethod::Method id = HttpMethod::parse(method);
+    if (method.empty()) {
+        // any method
+    } else if (id != HttpMethod::Other) {
+        r = &e.methods[id];
+        e.allowed |= 1u << id;
+    } else {
+        CustomRoute c;
+        c.method = method;
+        e.custom.push_back(c);
+        r = &e.custom.back().route;
+    }
+    r->handler = &handler;
+    return true;
+}
+
+bool Router::use(const std::string& path, MiddlewareFunc mw, const char* name) {
+    if (frozen) {
+        return false;
+    }
+    std::vector<std::string> segments = splitPath(path, false);
+    bool subtree = segments.back() == "*";
+    if (subtree) {
+        segments.pop_back();
+    }
+    Node* n = insert(segments);
+    size_t i = addStage(mw, name, path);
+    (subtree ? n->subtreeStages : n->routeStages).push_back(i);
+    return true;
+}
+
+bool Router::get(const std::string& path, HandlerFunc handler) {
+    return get(path, *wrap(handler));
+}
+
+bool Router::get(const std::string& path, RouteHandler& handler) {
+    return add(false, path, "GET", handler);
+}
+
+bool Router::get(const std::string& path, const Response::Prepared& response) {
+    return get(path, *wrap(response));
+}
+
+bool Router::head(const std::string& path, HandlerFunc handler) {
+    return head(path, *wrap(handler));
+}
+
+bool Router::head(const std::string& path, RouteHandler& handler) {
+    return add(false, path, "HEAD", handler);
+}
+
+bool Router::post(const std::string& path, HandlerFunc handler) {
+    return post(path, *wrap(handler));
+}
+
+bool Router::post(const std::string& path, RouteHandler& handler) {
+    return add(false, path, "POST", handler);
+}
+
+bool Router::put(const std::string& path, HandlerFunc handler) {
+    return put(path, *wrap(handler));
+}
+
+bool Router::put(const std::string& path, RouteHandler& handler) {
+    return add(false, path, "PUT", handler);
+}
+
+bool Router::patch(const std::string& path, HandlerFunc handler) {
+    return patch(path, *wrap(handler));
+}
+
+bool Router::patch(const std::string& path, RouteHandler& handler) {
+    return add(false, path, "PATCH", handler);
+}
+
+bool Router::del(const std::string& path, HandlerFunc handler) {
+    return del(path, *wrap(handler));
+}
+
+bool Router::del(const std::string& path, RouteHandler& handler) {
+    return add(false, path, "DELETE", handler);
+}
+
+bool Router::options(const std::string& path, HandlerFunc handler) {
+    return options(path, *wrap(handler));
+}
+
+bool Router::options(const std::string& path, RouteHandler& handler) {
+    return add(false, path, "OPTIONS", handler);
+}
+
+bool Router::route(const std::string& method, const std::string& path, HandlerFunc handler) {
+    return route(method, path, *wrap(handler));
+}
+
+bool Router::route(const std::string& method, const std::string& path, RouteHandler& handler) {
+    return add(false, path, method, handler);
+}
+
+bool Router::prefix(const std::string& pathPrefix, HandlerFunc handler) {
+    return prefix(pathPrefix, *wrap(handler));
+}
+
+bool Router::prefix(const std::string& pathPrefix, RouteHandler& handler) {
+    return add(true, pathPrefix, "", handler);
+}
+
+bool Router::prefix(const std::string& pathPrefix, const Response::Prepared& response) {
+    return prefix(pathPrefix, *wrap(response));
+}
+
+bool Router::setDefault(HandlerFunc handler) {
+    return setDefault(*wrap(handler));
+}
+
+bool Router::setDefault(RouteHandler& handler) {
+    if (frozen) {
+        return false;
+    }
     defaultHandler = &handler;
+    return true;
 }
 
-static bool startsWith(const std::string& str, const std::string& pfx) {
-    if (str.size() < pfx.size()) return false;
-    return str.compare(0, pfx.size(), pfx) == 0;
+bool Router::setDefault(const Response::Prepared& response) {
+    return setDefault(*wrap(response));
 }
 
-void Router::handle(Response::Writer& w, const Request& req) {
-    for (size_t i = 0; i < middlewares.size(); i++) {
-        if (!middlewares[i](w, req)) {
+void Router::setRate(Endpoint& e, size_t bytesPerSecond, size_t burst) {
+    for (int i = 0; i < HttpMethod::COUNT; i++) {
+        e.methods[i].rate = bytesPerSecond;
+        e.methods[i].burst = burst;
+    }
+    for (size_t i = 0; i < e.custom.size(); i++) {
+        e.custom[i].route.rate = bytesPerSecond;
+        e.custom[i].route.burst = burst;
+    }
+    e.any.rate = bytesPerSecond;
+    e.any.burst = burst;
+}
+
+bool Router::limit(const std::string& path, size_t bytesPerSecond, size_t burst) {
+    // An empty bucket never refills past zero and would pace forever
+    if (frozen || (bytesPerSecond > 0 && burst == 0)) {
+        return false;
+    }
+    bool found = false;
+    Node* n = lookupNode(splitPath(path, false));
+    if (n != NULL) {
+        setRate(n->exact, bytesPerSecond, burst);
+        found = true;
+    }
+    n = lookupNode(splitPath(path, true));
+    if (n != NULL) {
+        setRate(n->prefix, bytesPerSecond, burst);
+        found = true;
+    }
+    return found;
+}
+
+void Router::cacheRoute(Route& r, ResponseCache& cache, long ttlMs, long staleMs) {
+    if (r.handler != NULL) {
+        CachedRoute* h = new CachedRoute(*r.handler, cache, ttlMs, staleMs);
+        owned.push_back(h);
+        r.handler = h;
+    }
+}
+
+bool Router::cache(const std::string& path, ResponseCache& cache, long ttlMs, long staleMs) {
+    if (frozen) {
+        return false;
+    }
+    std::vector<std::string> segments = splitPath(path, false);
+    bool isPrefix = segments.back() == "*";
+    if (isPrefix) {
+        segments.pop_back();
+    }
+    Node* n = lookupNode(segments);
+    if (n == NULL) {
+        return false;
+    }
+    Endpoint& e = isPrefix ? n->prefix : n->exact;
+    cacheRoute(e.methods[HttpMethod::Get], cache, ttlMs, staleMs);
+    cacheRoute(e.methods[HttpMethod::Head], cache, ttlMs, staleMs);
+    // Other methods pass through
+    cacheRoute(e.any, cache, ttlMs, staleMs);
+    return true;
+}
+
+// Gathers the exact endpoints reachable through static segments only,
+// keyed by the path they answer
+void Router::collectExact(const Node* n, const std::string& path,
+                          std::vector<std::string>& keys) {
+    if (!n->exact.empty()) {
+        keys.push_back(path);
+        exactNodes.push_back(n);
+    }
+    for (size_t i = 0; i < n->children.size(); i++) {
+        const Node* c = n->children[i];
+        std::string p = path;
+        for (size_t k = 0; k < c->label.size(); k++) {
+            p += "/" + c->label[k];
+        }
+        collectExact(c, p, keys);
+    }
+}
+
+// outer holds the stages of every enclosing subtree, outermost first
+void Router::compose(Node* n, std::vector<size_t>& outer) {
+    size_t depth = outer.size();
+    outer.insert(outer.end(), n->subtreeStages.begin(), n->subtreeStages.end());
+    n->prefix.chain = outer;
+    n->exact.chain = outer;
+    n->exact.chain.insert(n->exact.chain.end(), n->routeStages.begin(), n->routeStages.end());
+    for (size_t i = 0; i < n->children.size(); i++) {
+        compose(n->children[i], outer);
+    }
+    if (n->param != NULL) {
+        compose(n->param, outer);
+    }
+    outer.resize(depth);
+}
+
+bool Router::freeze() {
+    frozen = true;
+    std::vector<size_t> outer = globalStages;
+    compose(root, outer);
+    std::vector<std::string> keys;
+    exactNodes.clear();
+    collectExact(root, "", keys);
+    if (!exactIndex.build(keys)) {
+        exactNodes.clear();
+        exactIndex.build(std::vector<std::string>());
+        return false;
+    }
+    return true;
+}
+
+const Router::Route* Router::pick(const Endpoint& e, HttpMethod::Method id, const std::string& method) {
+    if (id != HttpMethod::Other) {
+        if (e.allowed & (1u << id)) {
+            return &e.methods[id];
+        }
+        if (id == HttpMethod::Head && (e.allowed & (1u << HttpMethod::Get))) {
+            return &e.methods[HttpMethod::Get];
+        }
+    } else {
+        for (size_t i = 0; i < e.custom.size(); i++) {
+            if (e.custom[i].method == method) {
+                return &e.custom[i].route;
+            }
+        }
+    }
+    return e.any.handler != NULL ? &e.any : NULL;
+}
+
+// Walks the segments of a request path without copying it
+struct Router::Cursor {
+    const char* seg;
+    size_t len;
+    bool more; // seg is valid
+    const char* end;
+
+    Cursor(const char* p, const char* e) : seg(p), len(0), more(true), end(e) {
+        measure();
+    }
+
+    void measure() {
+        const char* q = seg;
+        while (q < end && *q != '/') {
+            q++;
+        }
+        len = static_cast<size_t>(q - seg);
+    }
+
+    void next() {
+        const char* q = seg + len;
+        if (q >= end) {
+            more = false;
             return;
         }
+        seg = q + 1;
+        measure();
     }
 
-    for (size_t i = 0; i < routes.size(); i++) {
-        const Route& r = routes[i];
+    // The unmatched rest of the path
+    StringView rest() const {
+        return more ? StringView(seg, static_cast<size_t>(end - seg)) : StringView();
+    }
+};
 
-        if (!r.method.empty() && r.method != req.getMethod()) {
-            continue;
+void Router::Lookup::bind(const char* name, const StringView& value) {
+    if (count < Request::MAX_PARAMS) {
+        params[count].name = name;
+        params[count].value = value;
+    }
+    count++;
+}
+
+const Router::Route* Router::pickOrNote(const Endpoint& e, Lookup& l) const {
+    const Route* r = pick(e, l.id, l.method);
+    if (r != NULL) {
+        l.hit = &e;
+    } else if (l.mismatch == NULL && !e.empty()) {
+        l.mismatch = &e;
+    }
+    return r;
+}
+
+// n has matched the path up to cur. Deeper matches win over prefix routes
+// here, and static children over the parameter child.
+const Router::Route* Router::match(const Node* n, Cursor cur, Lookup& l) const {
+    size_t bound = l.count;
+    if (!cur.more) {
+        const Route* r = pickOrNote(n->exact, l);
+        if (r != NULL) {
+            return r;
+        }
+    } else {
+        const Node* c = findChild(n, cur.seg, cur.len);
+        if (c != NULL) {
+            Cursor next = cur;
+            next.next();
+            bool ok = true;
+            for (size_t k = 1; k < c->label.size() && ok; k++) {
+                ok = next.more && compareSegment(c->label[k], next.seg, next.len) == 0;
+                next.next();
+            }
+            const Route* r = ok ? match(c, next, l) : NULL;
+            if (r != NULL) {
+                return r;
+            }
         }
+        if (n->param != NULL) {
+            Cursor next = cur;
+            next.next();
+            l.bind(n->param->paramName.c_str(), StringView(cur.seg, cur.len));
+            const Route* r = match(n->param, next, l);
+            if (r != NULL) {
+                return r;
+            }
+            l.count = bound;
+        }
+    }
+
+    const Route* r = pickOrNote(n->prefix, l);
+    if (r != NULL) {
+        l.bind("*", cur.rest());
+    }
+    return r;
+}
 
-        if (r.isPrefix) {
-            if (startsWith(req.getTarget(), r.path)) {
-                r.handler->handle(w, req);
-                return;
+// path is the target without its query
+const Router::Route* Router::lookup(const StringView& path, Lookup& l) const {
+    // Only origin-form targets have segments
+    if (path.empty() || path.data()[0] != '/') {
+        const Route* r = pickOrNote(root->prefix, l);
+        if (r != NULL) {
+            l.bind("*", StringView());
+        }
+        return r;
+    }
+    const char* begin = path.data();
+    size_t pathLen = path.size();
+    if (frozen) {
+        // A static exact route for the method is what the walk would find
+        // first; anything else needs the walk for fallbacks and 405
+        int i = exactIndex.find(begin, pathLen);
+        if (i >= 0) {
+            const Route* r = pick(exactNodes[i]->exact, l.id, l.method);
+            if (r != NULL) {
+                l.hit = &exactNodes[i]->exact;
+                return r;
             }
-        } else {
-            if (req.getTarget() == r.path) {
-                r.handler->handle(w, req);
-                return;
+        }
+    }
+    return match(root, Cursor(begin + 1, begin + pathLen), l);
+}
+
+RouteHandler* Router::find(const std::string& method, const std::string& target) const {
+    Lookup l(HttpMethod::parse(method), method);
+    const Route* r = lookup(StringView(target.data(), std::min(target.find('?'), target.size())), l);
+    return r != NULL ? r->handler : NULL;
+}
+
+// Answers a path that exists but not for this method
+void Router::writeAllowed(Response::Writer& w, const Endpoint& e, HttpMethod::Method id) {
+    std::string allow;
+    for (int i = 0; i < HttpMethod::COUNT; i++) {
+        bool has = (e.allowed & (1u << i)) != 0;
+        if (i == HttpMethod::Head) {
+            has = has || (e.allowed & (1u << HttpMethod::Get)) != 0;
+        } else if (i == HttpMethod::Options) {
+            has = true;
+        }
+        if (has) {
+            allow += allow.empty() ? "" : ", ";
+            allow += HttpMethod::name(static_cast<HttpMethod::Method>(i));
+        }
+    }
+    for (size_t i = 0; i < e.custom.size(); i++) {
+        allow += ", " + e.custom[i].method;
+    }
+
+    Headers h = Response::getDefaultHeaders(0);
+    h.set("allow", allow);
+    if (id == HttpMethod::Options) {
+        h.remove("content-length");
+        h.remove("content-type");
+        w.writeStatusLine(Response::StatusNoContent);
+    } else {
+        w.writeStatusLine(Response::StatusMethodNotAllowed);
+    }
+    w.writeHeaders(h);
+    w.flush();
+}
+
+static unsigned long elapsedNs(const struct timespec& from, const struct timespec& to) {
+    return static_cast<unsigned long>((to.tv_sec - from.tv_sec) * 1000000000L +
+                                      (to.tv_nsec - from.tv_nsec));
+}
+
+bool Router::runStages(const std::vector<size_t>& chain, Response::Writer& w, const Request& req) {
+    for (size_t i = 0; i < chain.size(); i++) {
+        Stage& st = stages[chain[i]];
+        if (!profiling) {
+            if (!st.func(w, req)) {
+                return false;
             }
+            continue;
+        }
+        // Loop threads may share the router, so counters are atomic
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool ok = st.func(w, req);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        __sync_fetch_and_add(&st.calls, 1UL);
+        __sync_fetch_and_add(&st.nanos, elapsedNs(start, end));
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<Router::StageStats> Router::stageStats() const {
+    std::vector<StageStats> out(stages.size());
+    for (size_t i = 0; i < stages.size(); i++) {
+        out[i].name = stages[i].name;
+        out[i].path = stages[i].path;
+        out[i].calls = stages[i].calls;
+        out[i].nanos = stages[i].nanos;
+    }
+    return out;
+}
+
+void Router::handle(Response::Writer& w, const Request& req) {
+    if (req.getMethodId() == HttpMethod::Head) {
+        w.suppressBody();
+    }
+
+    Lookup l(req.getMethodId(), req.getMethod());
+    const Route* r = lookup(req.getPath(), l);
+    if (r != NULL) {
+        req.setParams(l.params, l.count);
+    }
+    // Unrouted requests and unfrozen routers only run global middleware
+    const std::vector<size_t>& chain = (r != NULL && frozen) ? l.hit->chain : globalStages;
+    if (!runStages(chain, w, req)) {
+        return;
+    }
+
+    if (r != NULL) {
+        if (r->rate > 0) {
+            w.setRateLimit(r->rate, r->burst);
         }
+        r->handler->handle(w, req);
+        return;
+    }
+
+    if (l.mismatch != NULL) {
+        writeAllowed(w, *l.mismatch, req.getMethodId());
+        return;
     }
 
     if (defaultHandler) {
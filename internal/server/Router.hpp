@@ -2,6 +2,8 @@
 #define ROUTER_HPP
 
 #include "RequestHandler.hpp"
+#include "Request.hpp"
+#include "PerfectHash.hpp"
 #include <string>
 #include <vector>
 
@@ -10,6 +12,36 @@ struct RouteHandler {
     virtual ~RouteHandler() {}
 };
 
+// Routes are kept in a radix tree keyed on path segments, with chains of
+// single-child segments compressed into one node. A lookup walks the
+// target once: an exact route for the whole path wins, otherwise the
+// longest matching prefix route, otherwise the default handler.
+// Prefix routes match whole segments: "/httpbin/" and "/httpbin" both
+// match "/httpbin" and everything below it, but not "/httpbinx".
+//
+// Paths may contain ":name" segments, which match any one segment, and end
+// in "*", which makes the route a prefix route. Static segments are tried
+// before parameters. Parameters and the rest of the path below a prefix
+// ("*") are bound on the Request as views into its target.
+//
+// Each node indexes its handlers by the method parsed with the request.
+// HEAD is answered by the GET handler with the body suppressed. A path
+// that is registered but not for the request's method gets 405 with an
+// Allow header, or 204 with Allow for OPTIONS, unless a prefix route
+// higher up takes the request.
+//
+// Routes are registered first, then the router is frozen: exact paths
+// without parameters are compiled into a minimal perfect hash, so most
+// lookups cost two hashes and a compare before any tree walk. Registering
+// on a frozen router fails.
+//
+// Middleware runs before the handler and may answer the request itself by
+// returning false. Global middleware runs on every request; middleware on
+// a path runs for that exact route, or with a trailing "*" for every route
+// in the subtree. Freezing composes each endpoint's stages, outermost
+// first, into one flat list; until then only global middleware runs.
+class ResponseCache;
+
 class Router : public RequestHandler {
 public:
     typedef void (*HandlerFunc)(Response::Writer& w, const Request& req);
@@ -18,19 +50,71 @@ public:
     Router();
     ~Router();
 
-    void use(MiddlewareFunc mw);
+    // Per-stage counters, with the stage's name and registered path ("" for
+    // global middleware)
+    struct StageStats {
+        std::string name;
+        std::string path;
+        unsigned long calls;
+        unsigned long nanos;
+    };
+
+    bool use(MiddlewareFunc mw, const char* name = NULL);
+    bool use(const std::string& path, MiddlewareFunc mw, const char* name = NULL);
 
-    void get(const std::string& path, HandlerFunc handler);
-    void get(const std::string& path, RouteHandler& handler);
+    bool get(const std::string& path, HandlerFunc handler);
+    bool get(const std::string& path, RouteHandler& handler);
+    bool get(const std::string& path, const Response::Prepared& response);
+    bool head(const std::string& path, HandlerFunc handler);
+    bool head(const std::string& path, RouteHandler& handler);
+    bool post(const std::string& path, HandlerFunc handler);
+    bool post(const std::string& path, RouteHandler& handler);
+    bool put(const std::string& path, HandlerFunc handler);
+    bool put(const std::string& path, RouteHandler& handler);
+    bool patch(const std::string& path, HandlerFunc handler);
+    bool patch(const std::string& path, RouteHandler& handler);
+    bool del(const std::string& path, HandlerFunc handler);
+    bool del(const std::string& path, RouteHandler& handler);
+    bool options(const std::string& path, HandlerFunc handler);
+    bool options(const std::string& path, RouteHandler& handler);
+    // Any method token, including ones without an HttpMethod value
+    bool route(const std::string& method, const std::string& path, HandlerFunc handler);
+    bool route(const std::string& method, const std::string& path, RouteHandler& handler);
 
-    void prefix(const std::string& pathPrefix, HandlerFunc handler);
-    void prefix(const std::string& pathPrefix, RouteHandler& handler);
+    bool prefix(const std::string& pathPrefix, HandlerFunc handler);
+    bool prefix(const std::string& pathPrefix, RouteHandler& handler);
+    bool prefix(const std::string& pathPrefix, const Response::Prepared& response);
 
-    void setDefault(HandlerFunc handler);
-    void setDefault(RouteHandler& handler);
+    bool setDefault(HandlerFunc handler);
+    bool setDefault(RouteHandler& handler);
+    bool setDefault(const Response::Prepared& response);
+
+    // Paces streamed responses from routes registered under path to
+    // bytesPerSecond, allowing bursts of up to burst bytes. A burst of 0,
+    // or a path with no route registered, is rejected.
+    bool limit(const std::string& path, size_t bytesPerSecond, size_t burst);
+    // Serves GET and HEAD on the route at path, or with a trailing "*" on
+    // the prefix route there, from cache. Responses are fresh for ttlMs
+    // and may then be served stale for staleMs while one request
+    // refreshes them. Register the route first.
+    bool cache(const std::string& path, ResponseCache& cache, long ttlMs, long staleMs);
+
+    // Compiles the routes for lookup and rejects registration from then
+    // on. False if the routes could not be compiled; the tree still serves.
+    bool freeze();
+    bool isFrozen() const { return frozen; }
+
+    // Counts calls to each middleware stage and the time spent in it. Off
+    // by default: timing costs two clock reads per stage.
+    void setProfiling(bool on) { profiling = on; }
+    std::vector<StageStats> stageStats() const;
 
     void handle(Response::Writer& w, const Request& req);
 
+    // The handler a request would be dispatched to, or NULL if it would
+    // fall through to the default
+    RouteHandler* find(const std::string& method, const std::string& target) const;
+
 private:
     struct FuncHandler : public RouteHandler {
         HandlerFunc func;
@@ -38,19 +122,110 @@ private:
         void handle(Response::Writer& w, const Request& req) { func(w, req); }
     };
 
+    struct PreparedHandler : public RouteHandler {
+        const Response::Prepared& response;
+        PreparedHandler(const Response::Prepared& r) : response(r) {}
+        void handle(Response::Writer& w, const Request& req);
+    };
+
+    struct Stage {
+        MiddlewareFunc func;
+        std::string name;
+        std::string path;
+        unsigned long calls;
+        unsigned long nanos;
+    };
+
     struct Route {
+        RouteHandler* handler; // NULL if not registered
+        size_t rate;           // bytes per second, 0 for unlimited
+        size_t burst;
+
+        Route() : handler(NULL), rate(0), burst(0) {}
+    };
+
+    struct CustomRoute {
         std::string method;
-        std::string path;
-        bool isPrefix;
-        RouteHandler* handler;
+        Route route;
+    };
+
+    // The handlers registered for one path
+    struct Endpoint {
+        Route methods[HttpMethod::COUNT];
+        unsigned allowed; // bit per registered entry of methods
+        std::vector<CustomRoute> custom;
+        Route any; // prefix() routes answer every method
+        std::vector<size_t> chain; // stage indices, composed by freeze
+
+        Endpoint() : allowed(0) {}
+        bool empty() const { return allowed == 0 && custom.empty() && any.handler == NULL; }
+    };
+
+    struct Node {
+        std::vector<std::string> label; // one or more segments; empty at the root
+        std::vector<Node*> children;    // sorted by their first label segment
+        Node* param;                    // ":name" child, tried after children
+        std::string paramName;          // set on param nodes
+        Endpoint exact;
+        Endpoint prefix; // this path and everything below it
+        std::vector<size_t> routeStages;   // use(path) on the exact route
+        std::vector<size_t> subtreeStages; // use(path*) on the whole subtree
+
+        Node() : param(NULL) {}
+        ~Node();
     };
 
-    std::vector<MiddlewareFunc> middlewares;
-    std::vector<Route> routes;
+    struct Cursor;
+
+    std::vector<Stage> stages;
+    std::vector<size_t> globalStages;
+    bool profiling;
+    Node* root;
     RouteHandler* defaultHandler;
-    std::vector<FuncHandler*> owned;
+    std::vector<RouteHandler*> owned;
+    bool frozen;
+    PerfectHash exactIndex; // static exact paths, built by freeze
+    std::vector<const Node*> exactNodes; // indexed like exactIndex keys
+
+    Router(const Router&);
+    Router& operator=(const Router&);
 
     RouteHandler* wrap(HandlerFunc f);
+    RouteHandler* wrap(const Response::Prepared& response);
+
+    bool add(bool isPrefix, const std::string& path, const std::string& method,
+             RouteHandler& handler);
+    static size_t lowerBound(const std::vector<Node*>& children, const char* seg, size_t len);
+    static Node* findChild(const Node* n, const char* seg, size_t len);
+    static const Route* pick(const Endpoint& e, HttpMethod::Method id, const std::string& method);
+    static void setRate(Endpoint& e, size_t bytesPerSecond, size_t burst);
+    void cacheRoute(Route& r, ResponseCache& cache, long ttlMs, long staleMs);
+    static void writeAllowed(Response::Writer& w, const Endpoint& e, HttpMethod::Method id);
+    Node* insert(const std::vector<std::string>& segments);
+    Node* lookupNode(const std::vector<std::string>& segments) const;
+    static void compose(Node* n, std::vector<size_t>& outer);
+    bool runStages(const std::vector<size_t>& chain, Response::Writer& w, const Request& req);
+    size_t addStage(MiddlewareFunc mw, const char* name, const std::string& path);
+    void collectExact(const Node* n, const std::string& path,
+                      std::vector<std::string>& keys);
+    // Method and captures of the request being looked up, and the
+    // deepest endpoint whose path matched but not its method
+    struct Lookup {
+        HttpMethod::Method id;
+        const std::string& method;
+        PathParam params[Request::MAX_PARAMS];
+        size_t count;
+        const Endpoint* mismatch;
+        const Endpoint* hit; // owner of the returned route
+
+        Lookup(HttpMethod::Method i, const std::string& m)
+            : id(i), method(m), count(0), mismatch(NULL), hit(NULL) {}
+        void bind(const char* name, const StringView& value);
+    };
+
+    const Route* lookup(const StringView& path, Lookup& l) const;
+    const Route* match(const Node* n, Cursor cur, Lookup& l) const;
+    const Route* pickOrNote(const Endpoint& e, Lookup& l) const;
 };
 
 #endif
@@ -1,16 +1,29 @@
 #include "Server.hpp"
 #include "Request.hpp"
+#include "BodySource.hpp"
+#include "Util.hpp"
+#include <algorithm>
 #include <cerrno>
+#include <cstring>
+#include <ctime>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
 #include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
 
+// Bytes each ready connection may write per loop iteration
+static const size_t WRITE_QUANTUM = 64 * 1024;
+
 Server::Server() : closed(false), listenerFd(-1), epollFd(-1), handler(NULL) {}
 
 Server::~Server() {
+    while (!connections.empty()) {
+        closeConnection(connections.begin()->second);
+    }
     if (listenerFd >= 0) {
         ::close(listenerFd);
     }
@@ -20,21 +33,159 @@ Server::~Server() {
 }
 
 void Server::runConnection(int conn) {
-    Response::Writer w(conn);
+    Connection* c = new Connection(conn, &dates);
+    Response::Writer& w = c->writer;
 
     std::string parseErr;
     Request* req = Request::requestFromSocket(conn, parseErr);
     if (req == NULL) {
         w.writeStatusLine(Response::StatusBadRequest);
         w.writeHeaders(Response::getDefaultHeaders(0));
+        w.flush();
         ::close(conn);
+        delete c;
         return;
     }
 
     handler->handle(w, *req);
-
     delete req;
-    ::close(conn);
+
+    if (!w.pending()) {
+        w.flush();
+        ::close(conn);
+        delete c;
+        return;
+    }
+
+    // The handler left a body source or file: stream it from the loop
+    int flags = fcntl(conn, F_GETFL, 0);
+    fcntl(conn, F_SETFL, flags | O_NONBLOCK);
+    w.setNonBlocking();
+
+    struct epoll_event ev;
+    ev.events = 0;
+    ev.data.fd = conn;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, conn, &ev);
+    connections[conn] = c;
+    schedule(c);
+}
+
+void Server::schedule(Connection* c) {
+    if (!c->ready) {
+        c->ready = true;
+        runQueue.push_back(c);
+    }
+}
+
+void Server::runRound() {
+    // Connections queued during the round wait for the next one
+    size_t count = runQueue.size();
+    for (size_t i = 0; i < count && !runQueue.empty(); i++) {
+        Connection* c = runQueue.front();
+        runQueue.pop_front();
+        c->ready = false;
+        pumpConnection(c);
+    }
+}
+
+void Server::pumpConnection(Connection* c) {
+    if (c->wakeAt != 0) {
+        timers.erase(std::make_pair(c->wakeAt, c));
+        c->wakeAt = 0;
+    }
+    size_t quota = WRITE_QUANTUM;
+    Response::Writer::Progress progress = c->writer.pump(quota);
+    if (progress == Response::Writer::Done || progress == Response::Writer::Broken) {
+        closeConnection(c);
+        return;
+    }
+    if (progress == Response::Writer::Yield) {
+        // Still writable: go again next round
+        schedule(c);
+        return;
+    }
+    if (progress == Response::Writer::Paced) {
+        // Only the timer may resume it; readiness events would just spin
+        struct epoll_event ev;
+        ev.events = 0;
+        ev.data.fd = c->fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, c->fd, &ev);
+        if (c->sourceFd >= 0) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, c->sourceFd, NULL);
+            sources.erase(c->sourceFd);
+            c->sourceFd = -1;
+        }
+        sleepUntil(c, monotonicMs() + c->writer.pacingDelayMs());
+        return;
+    }
+
+    int waitFd = -1;
+    if (progress == Response::Writer::WantSource) {
+        waitFd = c->writer.bodySource()->waitFd();
+    }
+
+    struct epoll_event ev;
+    ev.events = 0;
+    if (progress == Response::Writer::WantWrite) {
+        ev.events = EPOLLOUT;
+    }
+    // WantCompletion needs no events: EPOLLERR is always reported
+    ev.data.fd = c->fd;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, c->fd, &ev);
+
+    if (waitFd >= 0 && c->sourceFd < 0) {
+        ev.events = EPOLLIN;
+        ev.data.fd = waitFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, waitFd, &ev);
+        c->sourceFd = waitFd;
+        sources[waitFd] = c;
+    } else if (waitFd < 0 && c->sourceFd >= 0) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, c->sourceFd, NULL);
+        sources.erase(c->sourceFd);
+        c->sourceFd = -1;
+    }
+}
+
+void Server::sleepUntil(Connection* c, long wakeAt) {
+    c->wakeAt = wakeAt;
+    timers.insert(std::make_pair(wakeAt, c));
+}
+
+void Server::wakeTimers(long now) {
+    while (!timers.empty() && timers.begin()->first <= now) {
+        Connection* c = timers.begin()->second;
+        timers.erase(timers.begin());
+        c->wakeAt = 0;
+        schedule(c);
+    }
+}
+
+int Server::waitTimeout(long now) const {
+    if (!runQueue.empty()) {
+        return 0;
+    }
+    if (timers.empty()) {
+        return -1;
+    }
+    long wait = timers.begin()->first - now;
+    return wait > 0 ? static_cast<int>(wait) : 0;
+}
+
+void Server::closeConnection(Connection* c) {
+    if (c->ready) {
+        runQueue.erase(std::find(runQueue.begin(), runQueue.end(), c));
+    }
+    if (c->wakeAt != 0) {
+        timers.erase(std::make_pair(c->wakeAt, c));
+    }
+    if (c->sourceFd >= 0) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, c->sourceFd, NULL);
+        sources.erase(c->sourceFd);
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, c->fd, NULL);
+    connections.erase(c->fd);
+    ::close(c->fd);
+    delete c;
 }
 
 void Server::run() {
@@ -44,11 +195,27 @@ void Server::run() {
     sigaddset(&mask, SIGTERM);
     sigprocmask(SIG_BLOCK, &mask, NULL);
 
+    // A client that goes away mid-stream must not take the server down
+    signal(SIGPIPE, SIG_IGN);
+
     int sfd = signalfd(-1, &mask, 0);
     if (sfd < 0) {
         return;
     }
 
+    // Ticks once per second to keep the cached Date header current
+    int tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK);
+    if (tfd < 0) {
+        ::close(sfd);
+        return;
+    }
+    struct itimerspec tick;
+    std::memset(&tick, 0, sizeof(tick));
+    tick.it_interval.tv_sec = 1;
+    tick.it_value.tv_sec = 1;
+    timerfd_settime(tfd, 0, &tick, NULL);
+    dates.refresh(std::time(NULL));
+
     struct epoll_event ev;
     ev.events = EPOLLIN;
     ev.data.fd = listenerFd;
@@ -58,10 +225,21 @@ void Server::run() {
     ev.data.fd = sfd;
     epoll_ctl(epollFd, EPOLL_CTL_ADD, sfd, &ev);
 
+    ev.events = EPOLLIN;
+    ev.data.fd = tfd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, tfd, &ev);
+
     struct epoll_event events[16];
 
     while (!closed) {
-        int n = epoll_wait(epollFd, events, 16, -1);
+        // Ready connections get another round as soon as events are
+        // checked; paced ones bound the wait by their wake time
+        int timeout = waitTimeout(monotonicMs());
+        if (timeout != 0) {
+            handler->offline();
+        }
+        int n = epoll_wait(epollFd, events, 16, timeout);
+        handler->quiescent();
         if (n < 0) {
             if (errno == EINTR) {
                 continue;
@@ -73,18 +251,45 @@ void Server::run() {
             if (events[i].data.fd == sfd) {
                 closed = true;
                 break;
+            } else if (events[i].data.fd == tfd) {
+                uint64_t expirations;
+                read(tfd, &expirations, sizeof(expirations));
+                dates.refresh(std::time(NULL));
             } else if (events[i].data.fd == listenerFd) {
                 int conn = accept(listenerFd, NULL, NULL);
                 if (conn >= 0) {
                     runConnection(conn);
                 }
+            } else {
+                int fd = events[i].data.fd;
+                std::map<int, Connection*>::iterator it = connections.find(fd);
+                if (it != connections.end()) {
+                    // EPOLLERR without a socket error means zero-copy
+                    // completions are queued
+                    uint32_t got = events[i].events;
+                    if ((got & EPOLLHUP) || ((got & EPOLLERR) && socketFailed(fd))) {
+                        closeConnection(it->second);
+                    } else {
+                        schedule(it->second);
+                    }
+                    continue;
+                }
+                it = sources.find(fd);
+                if (it != sources.end()) {
+                    schedule(it->second);
+                }
             }
         }
+        if (!closed) {
+            wakeTimers(monotonicMs());
+            runRound();
+        }
     }
 
     struct signalfd_siginfo fdsi;
     read(sfd, &fdsi, sizeof(fdsi));
     ::close(sfd);
+    ::close(tfd);
 }
 
 Server* Server::serve(uint16_t port, RequestHandler& h, std::string& errorMsg) {
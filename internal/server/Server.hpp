@@ -1,6 +1,9 @@
 #ifndef SERVER_HPP
 #define SERVER_HPP
 
+#include <deque>
+#include <map>
+#include <set>
 #include <string>
 #include <stdint.h>
 #include "RequestHandler.hpp"
@@ -21,8 +24,40 @@ private:
     int listenerFd;
     int epollFd;
     RequestHandler* handler;
+    Response::DateCache dates;
+
+    // A response whose body is still being streamed from a BodySource
+    struct Connection {
+        int fd;
+        int sourceFd; // body source fd registered with epoll, or -1
+        Response::Writer writer;
+        bool ready;  // queued in the run queue
+        long wakeAt; // monotonic ms when a paced writer may resume, or 0
+
+        Connection(int conn, const Response::DateCache* dates)
+            : fd(conn), sourceFd(-1), writer(conn, dates), ready(false), wakeAt(0) {}
+    };
+
+    std::map<int, Connection*> connections; // by socket fd
+    std::map<int, Connection*> sources;     // by body source fd
+
+    // Connections with output to send, served round-robin: each loop
+    // iteration lets every ready connection write up to a fixed quantum,
+    // so one fast bulk download cannot starve the rest of the loop.
+    std::deque<Connection*> runQueue;
+
+    // Rate-limited connections waiting for tokens, by wake time. The
+    // earliest one bounds the epoll_wait timeout.
+    std::set<std::pair<long, Connection*> > timers;
 
     void runConnection(int conn);
+    void schedule(Connection* c);
+    void runRound();
+    void sleepUntil(Connection* c, long wakeAt);
+    void wakeTimers(long now);
+    int waitTimeout(long now) const;
+    void pumpConnection(Connection* c);
+    void closeConnection(Connection* c);
 };
 
 #endif
@@ -0,0 +1,441 @@
+#include "StaticFileHandler.hpp"
+#include "Util.hpp"
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char NOT_FOUND[] = "Not Found\n";
+static const Response::Prepared PAGE_404(Response::StatusNotFound, Response::getDefaultHeaders(0),
+                                         NOT_FOUND, sizeof(NOT_FOUND) - 1);
+
+// Asked of the kernel when a file is opened, so the first sends hit the
+// page cache
+static const off_t READAHEAD = 2 * 1024 * 1024;
+
+// Any change to a watched file, or to the directory itself
+static const uint32_t WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE |
+                                   IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                   IN_DELETE_SELF | IN_MOVE_SELF;
+
+static const struct {
+    const char* ext;
+    const char* type;
+} CONTENT_TYPES[] = {
+    {"html", "text/html; charset=utf-8"},
+    {"htm", "text/html; charset=utf-8"},
+    {"css", "text/css; charset=utf-8"},
+    {"js", "text/javascript; charset=utf-8"},
+    {"mjs", "text/javascript; charset=utf-8"},
+    {"json", "application/json"},
+    {"txt", "text/plain; charset=utf-8"},
+    {"xml", "application/xml"},
+    {"svg", "image/svg+xml"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"ico", "image/x-icon"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+    {"gz", "application/gzip"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
+};
+
+const char* StaticFileHandler::contentType(const std::string& name) {
+    size_t dot = name.rfind('.');
+    if (dot != std::string::npos && name.find('/', dot) == std::string::npos) {
+        std::string ext = name.substr(dot + 1);
+        for (size_t i = 0; i < ext.size(); i++) {
+            if (ext[i] >= 'A' && ext[i] <= 'Z') {
+                ext[i] = static_cast<char>(ext[i] - 'A' + 'a');
+            }
+        }
+        for (size_t i = 0; i < sizeof(CONTENT_TYPES) / sizeof(CONTENT_TYPES[0]); i++) {
+            if (ext == CONTENT_TYPES[i].ext) {
+                return CONTENT_TYPES[i].type;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+// Percent-decodes a path below the root. False for bad escapes, NUL, and
+// empty, "." or ".." segments.
+static bool decodePath(const StringView& raw, std::string& out) {
+    out.clear();
+    for (size_t i = 0; i < raw.size(); i++) {
+        char c = raw.data()[i];
+        if (c == '%') {
+            int hi = i + 2 < raw.size() ? hexValue(raw.data()[i + 1]) : -1;
+            int lo = hi >= 0 ? hexValue(raw.data()[i + 2]) : -1;
+            if (lo < 0 || (hi == 0 && lo == 0)) {
+                return false;
+            }
+            c = static_cast<char>(hi * 16 + lo);
+            i += 2;
+        }
+        out += c;
+    }
+    size_t start = 0;
+    while (start <= out.size()) {
+        size_t slash = out.find('/', start);
+        if (slash == std::string::npos) {
+            slash = out.size();
+        }
+        std::string seg = out.substr(start, slash - start);
+        if (seg.empty() || seg == "." || seg == "..") {
+            return false;
+        }
+        start = slash + 1;
+    }
+    return true;
+}
+
+// A header block serialized by a capturing writer, with its Date slot
+static void serialize(Response::StatusCode status, const Headers& h,
+                      Response::Buffer& out, size_t& slot) {
+    std::string s;
+    Response::Writer w(-1);
+    w.capture(&s);
+    w.writeStatusLine(status);
+    w.writeHeaders(h);
+    w.flush();
+    out = Response::Buffer(s.data(), s.size());
+    slot = w.captureSlot();
+}
+
+static bool parseHttpDate(const std::string& s, time_t& out) {
+    struct tm tm;
+    std::memset(&tm, 0, sizeof(tm));
+    const char* end = strptime(s.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0') {
+        return false;
+    }
+    out = timegm(&tm);
+    return true;
+}
+
+// If-None-Match compares weakly: W/ prefixes are ignored
+static bool etagListMatches(const std::string& list, const std::string& etag) {
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t comma = list.find(',', start);
+        if (comma == std::string::npos) {
+            comma = list.size();
+        }
+        std::string tag = trim(list.substr(start, comma - start));
+        start = comma + 1;
+        if (tag.compare(0, 2, "W/") == 0) {
+            tag.erase(0, 2);
+        }
+        if (tag == "*" || tag == etag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+StaticFileHandler::Entry::~Entry() {
+    for (int c = 0; c < FileResponse::CODINGS; c++) {
+        if (variants[c].fd >= 0) {
+            close(variants[c].fd);
+        }
+    }
+}
+
+void StaticFileHandler::Entry::unref() {
+    if (__sync_sub_and_fetch(&refs, 1) == 0) {
+        delete this;
+    }
+}
+
+StaticFileHandler::StaticFileHandler(const std::string& r, size_t cap)
+    : root(r), capacity(cap > 0 ? cap : 1), notifyFd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+      clock(0), events(0) {
+    pthread_mutex_init(&lock, NULL);
+}
+
+StaticFileHandler::~StaticFileHandler() {
+    while (!entries.empty()) {
+        drop(entries.begin());
+    }
+    if (notifyFd >= 0) {
+        close(notifyFd);
+    }
+    pthread_mutex_destroy(&lock);
+}
+
+void StaticFileHandler::handle(Response::Writer& w, const Request& req) {
+    std::string path;
+    if (!decodePath(req.param("*"), path)) {
+        w.writePrepared(PAGE_404);
+        return;
+    }
+    serve(w, req, path);
+}
+
+void StaticFileHandler::serve(Response::Writer& w, const Request& req, const std::string& path) {
+    Entry* e = acquire(path);
+    if (e == NULL) {
+        w.writePrepared(PAGE_404);
+        return;
+    }
+    const Variant& v =
+        e->variants[FileResponse::negotiate(req.getHeaders().get("accept-encoding"), e->available)];
+    if (notModified(v, req)) {
+        w.writeSerialized(v.notModified, v.notModifiedSlot);
+    } else if (!req.getHeaders().get("range").empty()) {
+        FileResponse::send(w, req, v.fd, v.size, v.headers);
+    } else {
+        w.writeSerialized(v.ok, v.okSlot);
+        w.streamFile(v.fd, 0, static_cast<size_t>(v.size));
+    }
+    e->unref();
+}
+
+bool StaticFileHandler::notModified(const Variant& v, const Request& req) {
+    HttpMethod::Method id = req.getMethodId();
+    if (id != HttpMethod::Get && id != HttpMethod::Head) {
+        return false;
+    }
+    // If-None-Match takes precedence
+    std::string tags = req.getHeaders().get("if-none-match");
+    if (!tags.empty()) {
+        return etagListMatches(tags, v.etag);
+    }
+    std::string since = req.getHeaders().get("if-modified-since");
+    time_t t;
+    return !since.empty() && parseHttpDate(trim(since), t) && v.mtime <= t;
+}
+
+StaticFileHandler::Entry* StaticFileHandler::acquire(const std::string& path) {
+    pthread_mutex_lock(&lock);
+    readEvents();
+    std::map<std::string, Entry*>::iterator it = entries.find(path);
+    if (it != entries.end()) {
+        Entry* e = it->second;
+        e->lastUsed = ++clock;
+        __sync_fetch_and_add(&e->refs, 1);
+        pthread_mutex_unlock(&lock);
+        return e;
+    }
+    unsigned long seen = events;
+    pthread_mutex_unlock(&lock);
+
+    // Opening and serializing happen unlocked, so a miss does not stall
+    // hits on other files. Watch before opening, so a change after the
+    // fstat is not missed.
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? root : root + "/" + path.substr(0, slash);
+    int wd = notifyFd >= 0 ? inotify_add_watch(notifyFd, dir.c_str(), WATCH_MASK) : -1;
+    Entry* e = load(path, wd);
+
+    pthread_mutex_lock(&lock);
+    readEvents();
+    it = entries.find(path);
+    if (it != entries.end()) {
+        // Another request loaded it meanwhile
+        if (e != NULL) {
+            e->wd = -1;
+            e->unref();
+        }
+        e = it->second;
+        e->lastUsed = ++clock;
+        __sync_fetch_and_add(&e->refs, 1);
+    } else if (e != NULL && wd >= 0 && events == seen) {
+        watch(wd, dir);
+        if (entries.size() >= capacity) {
+            evict();
+        }
+        e->lastUsed = ++clock;
+        e->refs++;
+        entries[path] = e;
+        wd = -1;
+    } else if (e != NULL) {
+        // Any event while loading may have been for this file, and has
+        // been read, so the entry is served once and not kept
+        e->wd = -1;
+    }
+    // A watch no entry uses
+    if (wd >= 0 && watches.find(wd) == watches.end()) {
+        inotify_rm_watch(notifyFd, wd);
+    }
+    pthread_mutex_unlock(&lock);
+    return e;
+}
+
+StaticFileHandler::Entry* StaticFileHandler::load(const std::string& path, int wd) {
+    std::string full = root + "/" + path;
+    struct stat st[FileResponse::CODINGS];
+    int fds[FileResponse::CODINGS];
+    fds[FileResponse::Identity] = FileResponse::openRegular(full, st[FileResponse::Identity]);
+    if (fds[FileResponse::Identity] < 0) {
+        return NULL;
+    }
+
+    Entry* e = new Entry();
+    e->wd = wd;
+    e->name = path.substr(path.rfind('/') + 1);
+    e->available = 1u << FileResponse::Identity;
+    for (int c = FileResponse::Identity + 1; c < FileResponse::CODINGS; c++) {
+        fds[c] = FileResponse::openRegular(
+            full + FileResponse::codingSuffix(static_cast<FileResponse::Coding>(c)), st[c]);
+        // A sidecar older than the file was not rebuilt with it
+        if (fds[c] >= 0 && st[c].st_mtime < st[FileResponse::Identity].st_mtime) {
+            close(fds[c]);
+            fds[c] = -1;
+        }
+        if (fds[c] >= 0) {
+            e->available |= 1u << c;
+        }
+    }
+
+    const char* type = contentType(path);
+    for (int c = 0; c < FileResponse::CODINGS; c++) {
+        if (fds[c] < 0) {
+            continue;
+        }
+        const char* coding = FileResponse::codingName(static_cast<FileResponse::Coding>(c));
+        Variant& v = e->variants[c];
+        v.fd = fds[c];
+        // Bodies are sent front to back, so read ahead of the first sends
+        posix_fadvise(v.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(v.fd, 0, st[c].st_size < READAHEAD ? st[c].st_size : READAHEAD,
+                      POSIX_FADV_WILLNEED);
+        v.size = st[c].st_size;
+        v.mtime = st[c].st_mtime;
+
+        // Sidecars are told apart from the file, and each other, by suffix
+        std::ostringstream etag;
+        etag << '"' << std::hex << st[c].st_size << '-' << st[c].st_mtim.tv_sec << '.'
+             << st[c].st_mtim.tv_nsec;
+        if (coding != NULL) {
+            etag << '-' << coding;
+        }
+        etag << '"';
+        v.etag = etag.str();
+        std::string lastModified = Response::httpDate(st[c].st_mtime);
+
+        Headers validators;
+        validators.set("connection", "close");
+        validators.set("etag", v.etag);
+        if (!lastModified.empty()) {
+            validators.set("last-modified", lastModified);
+        }
+        if (e->available != 1u << FileResponse::Identity) {
+            validators.set("vary", "accept-encoding");
+        }
+        serialize(Response::StatusNotModified, validators, v.notModified, v.notModifiedSlot);
+
+        v.headers = validators;
+        v.headers.set("content-type", type);
+        v.headers.set("accept-ranges", "bytes");
+        if (coding != NULL) {
+            v.headers.set("content-encoding", coding);
+        }
+        Headers ok = v.headers;
+        std::ostringstream length;
+        length << st[c].st_size;
+        ok.set("content-length", length.str());
+        serialize(Response::StatusOk, ok, v.ok, v.okSlot);
+    }
+    return e;
+}
+
+// True if name is base or one of its sidecars
+static bool namesFile(const std::string& name, const std::string& base) {
+    if (name.compare(0, base.size(), base) != 0) {
+        return false;
+    }
+    if (name.size() == base.size()) {
+        return true;
+    }
+    for (int c = FileResponse::Identity + 1; c < FileResponse::CODINGS; c++) {
+        if (name.compare(base.size(), std::string::npos,
+                         FileResponse::codingSuffix(static_cast<FileResponse::Coding>(c))) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void StaticFileHandler::watch(int wd, const std::string& dir) {
+    // The same directory yields the same descriptor
+    std::map<int, Watch>::iterator it = watches.find(wd);
+    if (it == watches.end()) {
+        Watch w;
+        w.dir = dir;
+        w.users = 0;
+        it = watches.insert(std::make_pair(wd, w)).first;
+    }
+    it->second.users++;
+}
+
+void StaticFileHandler::unwatch(int wd) {
+    std::map<int, Watch>::iterator w = watches.find(wd);
+    if (w != watches.end() && --w->second.users == 0) {
+        inotify_rm_watch(notifyFd, wd);
+        watches.erase(w);
+    }
+}
+
+void StaticFileHandler::drop(std::map<std::string, Entry*>::iterator it) {
+    Entry* e = it->second;
+    entries.erase(it);
+    unwatch(e->wd);
+    e->unref();
+}
+
+void StaticFileHandler::readEvents() {
+    if (notifyFd < 0) {
+        return;
+    }
+    // Aligned for struct inotify_event
+    long buf[1024];
+    ssize_t n;
+    while ((n = read(notifyFd, buf, sizeof(buf))) > 0) {
+        const char* p = reinterpret_cast<const char*>(buf);
+        const char* end = p + n;
+        while (p < end) {
+            const struct inotify_event* ev = reinterpret_cast<const struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + ev->len;
+            events++;
+            bool all = (ev->mask & IN_Q_OVERFLOW) != 0;
+            // Events on the directory itself, or its removal, drop all of it
+            bool whole = ev->len == 0 || (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED));
+            std::string name = ev->len > 0 ? std::string(ev->name) : std::string();
+            std::map<std::string, Entry*>::iterator it = entries.begin();
+            while (it != entries.end()) {
+                const Entry* e = it->second;
+                if (all || (e->wd == ev->wd && (whole || namesFile(name, e->name)))) {
+                    drop(it++);
+                } else {
+                    ++it;
+                }
+            }
+            // The kernel has removed the watch already
+            if (ev->mask & IN_IGNORED) {
+                watches.erase(ev->wd);
+            }
+        }
+    }
+}
+
+void StaticFileHandler::evict() {
+    std::map<std::string, Entry*>::iterator victim = entries.end();
+    for (std::map<std::string, Entry*>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        if (victim == entries.end() || it->second->lastUsed < victim->second->lastUsed) {
+            victim = it;
+        }
+    }
+    if (victim != entries.end()) {
+        drop(victim);
+    }
+}
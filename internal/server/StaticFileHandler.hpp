@@ -0,0 +1,117 @@
+#ifndef STATICFILEHANDLER_HPP
+#define STATICFILEHANDLER_HPP
+
+#include "Router.hpp"
+#include "Buffer.hpp"
+#include "FileResponse.hpp"
+#include <map>
+#include <string>
+#include <ctime>
+#include <pthread.h>
+
+// Serves the files below a directory. Register it on a wildcard route;
+// the rest of the path names the file, e.g. after
+// router.get("/static/*", files) "/static/css/site.css" is
+// root + "/css/site.css". Paths with "." or ".." segments and anything
+// that is not a regular file get 404.
+//
+// Up to capacity files are kept open along with their size, validators
+// and their 200 and 304 header blocks serialized once, so a hit costs no
+// open, fstat or close. The directories of cached files are watched with
+// inotify, and an entry is dropped as soon as its file or directory
+// changes; without inotify every request opens the file.
+//
+// A file may have precompressed sidecars next to it, "name.br" and
+// "name.gz", no older than the file itself. They are served in its place,
+// with Content-Encoding and their own ETag, to requests whose
+// Accept-Encoding prefers them; responses for such files carry
+// Vary: Accept-Encoding.
+//
+// GET and HEAD answer If-None-Match and If-Modified-Since with 304 and
+// Range with FileResponse. File bodies, compressed or not, go out with
+// sendfile from the event loop.
+class StaticFileHandler : public RouteHandler {
+public:
+    explicit StaticFileHandler(const std::string& root, size_t capacity = 256);
+    ~StaticFileHandler();
+
+    void handle(Response::Writer& w, const Request& req);
+    // Serves the file at path below root as handle() would, for routes
+    // that name one file themselves. path is not decoded or checked.
+    void serve(Response::Writer& w, const Request& req, const std::string& path);
+
+    // Files held open, each with its sidecars
+    size_t cached() const { return entries.size(); }
+
+    // Guesses a Content-Type from a file name's extension
+    static const char* contentType(const std::string& name);
+
+private:
+    // The file as it is, or one of its precompressed sidecars
+    struct Variant {
+        int fd; // -1 if absent
+        off_t size;
+        time_t mtime;
+        Headers headers; // for ranges, without Content-Length
+        std::string etag;
+        Response::Buffer ok; // 200 header block, without Date and Server
+        size_t okSlot;
+        Response::Buffer notModified; // 304 header block
+        size_t notModifiedSlot;
+
+        Variant() : fd(-1), size(0), mtime(0), okSlot(0), notModifiedSlot(0) {}
+    };
+
+    struct Entry {
+        int refs; // the cache's and each request's
+        int wd;           // watch on the file's directory, -1 if none
+        std::string name; // within that directory
+        Variant variants[FileResponse::CODINGS];
+        unsigned available; // bit per variant with an fd
+        unsigned long lastUsed;
+
+        Entry() : refs(1), wd(-1), available(0), lastUsed(0) {}
+        ~Entry();
+        void unref();
+
+    private:
+        Entry(const Entry&);
+        Entry& operator=(const Entry&);
+    };
+
+    // A directory watch and the number of entries in it
+    struct Watch {
+        std::string dir;
+        size_t users;
+    };
+
+    std::string root;
+    size_t capacity;
+    int notifyFd; // -1 without inotify
+    std::map<std::string, Entry*> entries; // by path below root
+    std::map<int, Watch> watches;
+    unsigned long clock;
+    unsigned long events; // inotify events read so far
+    pthread_mutex_t lock;
+
+    StaticFileHandler(const StaticFileHandler&);
+    StaticFileHandler& operator=(const StaticFileHandler&);
+
+    // The entry for path, referenced for the caller, or NULL if there is
+    // no such file
+    Entry* acquire(const std::string& path);
+    // Opens path and its sidecars and serializes their headers; called
+    // without the lock
+    Entry* load(const std::string& path, int wd);
+    // Counts an entry against wd, a watch on dir
+    void watch(int wd, const std::string& dir);
+    void unwatch(int wd);
+    void drop(std::map<std::string, Entry*>::iterator it);
+    // Drops the entries named by pending inotify events
+    void readEvents();
+    void evict();
+
+    static bool notModified(const Variant& v, const Request& req);
+};
+
+#endif
@@ -0,0 +1,91 @@
+#include "VirtualHosts.hpp"
+#include "Router.hpp"
+#include "Request.hpp"
+#include <algorithm>
+
+RequestHandler* VirtualHosts::Names::find(const char* name, size_t len) const {
+    int i = index.find(name, len);
+    return i >= 0 ? handlers[i] : NULL;
+}
+
+bool VirtualHosts::Names::add(const std::string& name, RequestHandler* h) {
+    if (find(name.data(), name.size()) != NULL) {
+        return false;
+    }
+    keys.push_back(name);
+    handlers.push_back(h);
+    if (!index.build(keys)) {
+        keys.pop_back();
+        handlers.pop_back();
+        index.build(keys);
+        return false;
+    }
+    return true;
+}
+
+VirtualHosts::VirtualHosts() : defaultHandler(NULL) {}
+
+bool VirtualHosts::add(const std::string& host, Router& router) {
+    if (!router.isFrozen()) {
+        return false;
+    }
+    return add(host, static_cast<RequestHandler&>(router));
+}
+
+bool VirtualHosts::add(const std::string& host, RequestHandler& handler) {
+    bool wildcard = host.size() > 2 && host[0] == '*' && host[1] == '.';
+    std::string name = Request::normalizeHost(wildcard ? host.substr(2) : host);
+    if (name.empty() || !(wildcard ? wildcards : exact).add(name, &handler)) {
+        return false;
+    }
+    if (std::find(sites.begin(), sites.end(), &handler) == sites.end()) {
+        sites.push_back(&handler);
+    }
+    return true;
+}
+
+void VirtualHosts::setDefault(RequestHandler& handler) {
+    defaultHandler = &handler;
+    if (std::find(sites.begin(), sites.end(), &handler) == sites.end()) {
+        sites.push_back(&handler);
+    }
+}
+
+// host is already normalized
+RequestHandler* VirtualHosts::find(const std::string& host) const {
+    RequestHandler* h = exact.find(host.data(), host.size());
+    if (h != NULL) {
+        return h;
+    }
+    // Try each parent domain, longest first
+    for (size_t dot = host.find('.'); dot != std::string::npos; dot = host.find('.', dot + 1)) {
+        h = wildcards.find(host.data() + dot + 1, host.size() - dot - 1);
+        if (h != NULL) {
+            return h;
+        }
+    }
+    return defaultHandler;
+}
+
+void VirtualHosts::handle(Response::Writer& w, const Request& req) {
+    RequestHandler* h = find(req.getHost());
+    if (h == NULL) {
+        w.writeStatusLine(Response::StatusMisdirectedRequest);
+        w.writeHeaders(Response::getDefaultHeaders(0));
+        w.flush();
+        return;
+    }
+    h->handle(w, req);
+}
+
+void VirtualHosts::quiescent() {
+    for (size_t i = 0; i < sites.size(); i++) {
+        sites[i]->quiescent();
+    }
+}
+
+void VirtualHosts::offline() {
+    for (size_t i = 0; i < sites.size(); i++) {
+        sites[i]->offline();
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef VIRTUALHOSTS_HPP
+#define VIRTUALHOSTS_HPP
+
+#include "RequestHandler.hpp"
+#include "PerfectHash.hpp"
+#include <string>
+#include <vector>
+
+class Router;
+
+// Dispatches on the request's normalized Host to one handler per site,
+// usually a frozen Router or a RouteTable. Names are looked up in perfect
+// hashes rebuilt on registration, so register every host before serving.
+//
+// "*.example.com" matches any name below example.com but not example.com
+// itself; the longest matching wildcard wins. Requests for unknown hosts
+// go to the default handler, or get 421 if there is none.
+class VirtualHosts : public RequestHandler {
+public:
+    VirtualHosts();
+
+    // False if host is empty or already registered, or router is not frozen
+    bool add(const std::string& host, Router& router);
+    bool add(const std::string& host, RequestHandler& handler);
+    void setDefault(RequestHandler& handler);
+
+    // The handler a request for host would go to, or NULL
+    RequestHandler* find(const std::string& host) const;
+
+    void handle(Response::Writer& w, const Request& req);
+    // Forwarded to every site, so route tables below can reclaim
+    void quiescent();
+    void offline();
+
+private:
+    struct Names {
+        std::vector<std::string> keys;
+        std::vector<RequestHandler*> handlers; // by key index
+        PerfectHash index;
+
+        RequestHandler* find(const char* name, size_t len) const;
+        bool add(const std::string& name, RequestHandler* h);
+    };
+
+    Names exact;
+    Names wildcards; // keyed by the suffix after "*."
+    RequestHandler* defaultHandler;
+    std::vector<RequestHandler*> sites; // each handler once
+
+    VirtualHosts(const VirtualHosts&);
+    VirtualHosts& operator=(const VirtualHosts&);
+};
+
+#endif
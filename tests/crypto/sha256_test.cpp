@@ -66,3 +66,24 @@ TEST_CASE("toHexStr produces correct output", "[crypto][sha256]") {
     CHECK(Crypto::toHexStr(bytes, 0).empty());
     CHECK(Crypto::toHexStr(bytes, 1) == "00");
 }
+
+TEST_CASE("Incremental SHA256 matches one-shot for any split", "[crypto][sha256]") {
+    int len = GENERATE(0, 1, 63, 64, 65, 200);
+    int step = GENERATE(1, 7, 64, 100);
+
+    std::string input(len, '\0');
+    for (int i = 0; i < len; i++) {
+        input[i] = static_cast<char>(i * 31 + 7);
+    }
+
+    Crypto::Sha256 ctx;
+    for (int i = 0; i < len; i += step) {
+        int n = (len - i < step) ? len - i : step;
+        ctx.update(reinterpret_cast<const unsigned char*>(input.data()) + i, n);
+    }
+    unsigned char hash[32];
+    ctx.final(hash);
+
+    CAPTURE(len, step);
+    CHECK(Crypto::toHexStr(hash, 32) == openssl_sha256(input));
+}
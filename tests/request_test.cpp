@@ -55,6 +55,96 @@ TEST_CASE("Good GET Request line", "[request]") {
     delete r;
 }
 
+TEST_CASE("Methods are parsed once into an id", "[request]") {
+    std::string errorMsg;
+    const char* lines[] = {"GET", "HEAD", "DELETE", "OPTIONS", "PURGE", "get"};
+    HttpMethod::Method ids[] = {HttpMethod::Get, HttpMethod::Head, HttpMethod::Delete,
+                                HttpMethod::Options, HttpMethod::Other, HttpMethod::Other};
+    for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) {
+        std::string data = std::string(lines[i]) + " / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        Request* r = parseFromString(data, errorMsg);
+        REQUIRE(r != NULL);
+        CHECK(r->getMethodId() == ids[i]);
+        CHECK(r->getMethod() == lines[i]);
+        delete r;
+    }
+}
+
+TEST_CASE("The target is split into path and query once", "[request][query]") {
+    std::string errorMsg;
+    Request* r = parseFromString("GET /search?q=a+b%21&empty=&flag&&q=2 HTTP/1.1\r\nHost: localhost\r\n\r\n", errorMsg);
+    REQUIRE(r != NULL);
+    CHECK(r->getPath() == "/search");
+    CHECK(r->getQuery() == "q=a+b%21&empty=&flag&&q=2");
+    CHECK(r->getQuery().data() == r->getTarget().data() + 8);
+
+    Query::Iterator it = r->queryParams();
+    StringView key, value;
+    const char* pairs[][2] = {{"q", "a+b%21"}, {"empty", ""}, {"flag", ""}, {"q", "2"}};
+    for (size_t i = 0; i < 4; i++) {
+        REQUIRE(it.next(key, value));
+        CHECK(key == pairs[i][0]);
+        CHECK(value == pairs[i][1]);
+    }
+    CHECK_FALSE(it.next(key, value));
+
+    // The first match wins and values stay raw until decoded
+    REQUIRE(r->queryParam("q", value));
+    CHECK(value == "a+b%21");
+    CHECK_FALSE(r->queryParam("missing", value));
+    delete r;
+
+    r = parseFromString("GET /plain HTTP/1.1\r\nHost: localhost\r\n\r\n", errorMsg);
+    REQUIRE(r != NULL);
+    CHECK(r->getPath() == "/plain");
+    CHECK(r->getQuery().empty());
+    CHECK_FALSE(r->queryParams().next(key, value));
+    delete r;
+}
+
+TEST_CASE("Query values are decoded only when needed", "[request][query]") {
+    char buf[64];
+    StringView out;
+
+    // Long enough to cover the vector loop and its scalar tail
+    std::string plain(40, 'x');
+    CHECK_FALSE(Query::needsDecoding(plain));
+    REQUIRE(Query::decode(plain, buf, sizeof(buf), out));
+    CHECK(out.data() == plain.data());
+    std::string late = plain + "%41";
+    CHECK(Query::needsDecoding(late));
+    CHECK(Query::needsDecoding(std::string(20, 'x') + "+" + std::string(20, 'x')));
+
+    REQUIRE(Query::decode(StringView("a+b%21%7e"), buf, sizeof(buf), out));
+    CHECK(out == "a b!~");
+    CHECK(out.data() == buf);
+    // Malformed escapes are kept
+    REQUIRE(Query::decode(StringView("100%%zz%4"), buf, sizeof(buf), out));
+    CHECK(out == "100%%zz%4");
+    CHECK_FALSE(Query::decode(StringView("a%20b"), buf, 2, out));
+
+    // Escaped parameter names match their decoded form
+    std::string errorMsg;
+    Request* r = parseFromString("GET /?first%20name=Ada HTTP/1.1\r\nHost: localhost\r\n\r\n", errorMsg);
+    REQUIRE(r != NULL);
+    REQUIRE(r->queryParam("first name", out));
+    CHECK(out == "Ada");
+    delete r;
+}
+
+TEST_CASE("The Host header is normalized once", "[request][host]") {
+    std::string errorMsg;
+    Request* r = parseFromString("GET / HTTP/1.1\r\nHost: API.Example.COM.:8080\r\n\r\n", errorMsg);
+    REQUIRE(r != NULL);
+    CHECK(r->getHost() == "api.example.com");
+    delete r;
+
+    CHECK(Request::normalizeHost("[::1]:80") == "[::1]");
+    CHECK(Request::normalizeHost("[::1]") == "[::1]");
+    CHECK(Request::normalizeHost("localhost") == "localhost");
+    CHECK(Request::normalizeHost("") == "");
+}
+
 TEST_CASE("Good GET Request line with path", "[request]") {
     std::string data = "GET /coffee HTTP/1.1\r\nHost: localhost:42069\r\nUser-Agent: curl/7.81.0\r\nAccept: */*\r\n\r\n";
     std::string errorMsg;
@@ -2,7 +2,17 @@
 #include <string>
 #include <cstring>
 #include <unistd.h>
+#include <poll.h>
+#include <cstdlib>
+#include <sstream>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include "Response.hpp"
+#include "TrailerDigest.hpp"
+#include <zlib.h>
+#include "BodySource.hpp"
+#include "TokenBucket.hpp"
+#include <fcntl.h>
 
 static std::string readAll(int fd) {
     std::string result;
@@ -61,3 +71,675 @@ TEST_CASE("Multiple chunks in sequence", "[response][chunked]") {
 
     CHECK(output == "2\r\nHi\r\n6\r\nWorld!\r\n0\r\n\r\n");
 }
+
+static bool pipeIsEmpty(int fd) {
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    return poll(&p, 1, 0) == 0;
+}
+
+TEST_CASE("Status line and headers are held until the body", "[response][writev]") {
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+
+    Response::Writer w(fds[1]);
+    Headers h;
+    h.set("Content-Length", "5");
+    REQUIRE(w.writeStatusLine(Response::StatusOk));
+    REQUIRE(w.writeHeaders(h));
+    CHECK(pipeIsEmpty(fds[0]));
+
+    REQUIRE(w.writeBody("Hello", 5));
+    close(fds[1]);
+
+    std::string output = readAll(fds[0]);
+    close(fds[0]);
+
+    CHECK(output == "HTTP/1.1 200 OK\r\ncontent-length: 5\r\n\r\nHello");
+}
+
+TEST_CASE("flush writes a response without a body", "[response][writev]") {
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+
+    Response::Writer w(fds[1]);
+    REQUIRE(w.writeStatusLine(Response::StatusBadRequest));
+    REQUIRE(w.writeHeaders(Headers()));
+    REQUIRE(w.flush());
+    REQUIRE(w.flush());
+    close(fds[1]);
+
+    std::string output = readAll(fds[0]);
+    close(fds[0]);
+
+    CHECK(output == "HTTP/1.1 400 Bad Request\r\n\r\n");
+}
+
+TEST_CASE("Chunk size is written in hex", "[response][chunked]") {
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+
+    std::string data(300, 'x');
+    Response::Writer w(fds[1]);
+    REQUIRE(w.writeChunkedBody(data.data(), data.size()));
+    close(fds[1]);
+
+    std::string output = readAll(fds[0]);
+    close(fds[0]);
+
+    CHECK(output == "12c\r\n" + data + "\r\n");
+}
+
+static int tempFileWith(const std::string& contents) {
+    char path[] = "/tmp/response_testXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (write(fd, contents.data(), contents.size()) != static_cast<ssize_t>(contents.size())) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+TEST_CASE("writeFile sends headers followed by a file range", "[response][sendfile]") {
+    int file = tempFileWith("0123456789");
+    REQUIRE(file >= 0);
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    Response::Writer w(fds[1]);
+    REQUIRE(w.writeStatusLine(Response::StatusOk));
+    REQUIRE(w.writeHeaders(Headers()));
+    REQUIRE(w.writeFile(file, 2, 5));
+    close(fds[1]);
+    close(file);
+
+    std::string output = readAll(fds[0]);
+    close(fds[0]);
+
+    CHECK(output == "HTTP/1.1 200 OK\r\n\r\n23456");
+}
+
+TEST_CASE("writeFile fails when the file is too short", "[response][sendfile]") {
+    int file = tempFileWith("abc");
+    REQUIRE(file >= 0);
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+
+    Response::Writer w(fds[1]);
+    CHECK_FALSE(w.writeFile(file, 0, 10));
+    close(fds[1]);
+    close(file);
+
+    std::string output = readAll(fds[0]);
+    close(fds[0]);
+
+    CHECK(output == "abc");
+}
+
+TEST_CASE("Prepared response is serialized once with Content-Length", "[response][prepared]") {
+    Headers h;
+    h.set("Content-Type", "text/plain");
+    Response::Prepared p(Response::StatusOk, h, "pong", 4);
+
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+
+    Response::Writer w(fds[1]);
+    REQUIRE(w.writePrepared(p));
+    REQUIRE(w.writePrepared(p));
+    close(fds[1]);
+
+    std::string output = readAll(fds[0]);
+    close(fds[0]);
+
+    std::string one = "HTTP/1.1 200 OK\r\ncontent-length: 4\r\ncontent-type: text/plain\r\n"
+                      "vary: Accept-Encoding\r\n\r\npong";
+    CHECK(output == one + one);
+    std::string data(p.data().data(), p.data().size());
+    CHECK(data.substr(p.slot()) == "\r\npong");
+}
+
+TEST_CASE("DateCache formats an IMF-fixdate", "[response][date]") {
+    Response::DateCache dates;
+    dates.refresh(0);
+    CHECK(dates.lines() == "date: Thu, 01 Jan 1970 00:00:00 GMT\r\nserver: httpfromtcp\r\n");
+    dates.refresh(784111777);
+    CHECK(dates.lines() == "date: Sun, 06 Nov 1994 08:49:37 GMT\r\nserver: httpfromtcp\r\n");
+}
+
+TEST_CASE("Cached Date lines are spliced into responses", "[response][date]") {
+    Response::DateCache dates;
+    dates.refresh(784111777);
+    Response::Prepared p(Response::StatusOk, Headers(), "hi", 2);
+
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+
+    Response::Writer w(fds[1], &dates);
+    REQUIRE(w.writeStatusLine(Response::StatusBadRequest));
+    REQUIRE(w.writeHeaders(Headers()));
+    REQUIRE(w.writePrepared(p));
+    close(fds[1]);
+
+    std::string output = readAll(fds[0]);
+    close(fds[0]);
+
+    CHECK(output == "HTTP/1.1 400 Bad Request\r\n" + dates.lines() + "\r\n"
+                    "HTTP/1.1 200 OK\r\ncontent-length: 2\r\nvary: Accept-Encoding\r\n" +
+                    dates.lines() + "\r\nhi");
+}
+
+TEST_CASE("A captured response replays with fresh Date lines", "[response][capture]") {
+    Response::DateCache dates;
+    dates.refresh(784111777);
+
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    std::string captured;
+    {
+        Response::Writer w(fds[1], &dates);
+        w.capture(&captured);
+        REQUIRE(w.writeStatusLine(Response::StatusOk));
+        REQUIRE(w.writeHeaders(Response::getDefaultHeaders(5)));
+        REQUIRE(w.writeBody("hello", 5));
+        CHECK(w.captured());
+        CHECK(w.captureSlot() == std::strlen("HTTP/1.1 200 OK\r\n"));
+    }
+    close(fds[1]);
+    std::string sent = readAll(fds[0]);
+    close(fds[0]);
+
+    // The capture is the response minus its Date and Server lines
+    CHECK(captured.size() + dates.lines().size() == sent.size());
+
+    dates.refresh(784111778);
+    REQUIRE(pipe(fds) == 0);
+    {
+        Response::Writer w(fds[1], &dates);
+        Response::Buffer data(captured.data(), captured.size());
+        REQUIRE(w.writeSerialized(data, std::strlen("HTTP/1.1 200 OK\r\n")));
+    }
+    close(fds[1]);
+    std::string replayed = readAll(fds[0]);
+    close(fds[0]);
+    CHECK(replayed.find(dates.lines()) == std::strlen("HTTP/1.1 200 OK\r\n"));
+    CHECK(replayed.size() == sent.size());
+
+    // Streamed bodies cannot be captured; a writer on -1 only captures
+    captured.clear();
+    Response::Writer shadow(-1);
+    shadow.capture(&captured);
+    REQUIRE(shadow.writeStatusLine(Response::StatusOk));
+    REQUIRE(shadow.flush());
+    CHECK(captured == "HTTP/1.1 200 OK\r\n");
+    shadow.stream(new Response::FdSource(-1));
+    CHECK_FALSE(shadow.captured());
+}
+
+TEST_CASE("Small chunks are coalesced up to the target size", "[response][chunked]") {
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+
+    Response::Writer w(fds[1]);
+    w.setChunking(8, 0);
+    REQUIRE(w.writeChunkedBody("abc", 3));
+    REQUIRE(w.writeChunkedBody("def", 3));
+    CHECK(pipeIsEmpty(fds[0]));
+    REQUIRE(w.writeChunkedBody("ghi", 3));
+    REQUIRE(w.writeChunkedBody("jk", 2));
+    REQUIRE(w.flush());
+    REQUIRE(w.writeChunkedBody("l", 1));
+    REQUIRE(w.writeChunkedBodyDone());
+    close(fds[1]);
+
+    std::string output = readAll(fds[0]);
+    close(fds[0]);
+
+    CHECK(output == "9\r\nabcdefghi\r\n2\r\njk\r\n1\r\nl\r\n0\r\n\r\n");
+}
+
+TEST_CASE("Coalesced chunks are sent once the delay has passed", "[response][chunked]") {
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+
+    Response::Writer w(fds[1]);
+    w.setChunking(1024, 10);
+    REQUIRE(w.writeChunkedBody("ab", 2));
+    usleep(20000);
+    REQUIRE(w.writeChunkedBody("cd", 2));
+    CHECK_FALSE(pipeIsEmpty(fds[0]));
+    REQUIRE(w.writeChunkedBodyDone());
+    close(fds[1]);
+
+    std::string output = readAll(fds[0]);
+    close(fds[0]);
+
+    CHECK(output == "4\r\nabcd\r\n0\r\n\r\n");
+}
+
+TEST_CASE("Declared trailers are computed from the chunked body", "[response][trailers]") {
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+
+    Response::Writer w(fds[1]);
+    Response::Sha256Digest sha;
+    Response::LengthDigest length;
+    Response::Crc32Digest crc;
+    w.addTrailer("X-Content-SHA256", sha);
+    w.addTrailer("X-Content-Length", length);
+    w.addTrailer("X-Content-CRC32", crc);
+    REQUIRE(w.writeStatusLine(Response::StatusOk));
+    REQUIRE(w.writeHeaders(Headers()));
+    REQUIRE(w.writeChunkedBody("1234", 4));
+    REQUIRE(w.writeChunkedBody("56789", 5));
+    REQUIRE(w.writeChunkedBodyDone());
+    close(fds[1]);
+
+    std::string output = readAll(fds[0]);
+    close(fds[0]);
+
+    CHECK(output == "HTTP/1.1 200 OK\r\n"
+                    "trailer: X-Content-SHA256, X-Content-Length, X-Content-CRC32\r\n\r\n"
+                    "4\r\n1234\r\n5\r\n56789\r\n0\r\n"
+                    "X-Content-SHA256: 15e2b0d3c33891ebb0f1ef609ec419420c20e320ce94c65fbc8c3312448eb225\r\n"
+                    "X-Content-Length: 9\r\n"
+                    "X-Content-CRC32: cbf43926\r\n\r\n");
+}
+
+static std::string inflateAll(const std::string& data) {
+    z_stream s;
+    std::memset(&s, 0, sizeof(s));
+    if (inflateInit2(&s, 15 + 32) != Z_OK) {
+        return "";
+    }
+    s.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    s.avail_in = static_cast<uInt>(data.size());
+    std::string out;
+    char buf[4096];
+    int rc = Z_OK;
+    while (rc == Z_OK) {
+        s.next_out = reinterpret_cast<Bytef*>(buf);
+        s.avail_out = sizeof(buf);
+        rc = inflate(&s, Z_NO_FLUSH);
+        out.append(buf, sizeof(buf) - s.avail_out);
+    }
+    inflateEnd(&s);
+    return rc == Z_STREAM_END ? out : "";
+}
+
+TEST_CASE("Accept-Encoding negotiation", "[response][compression]") {
+    CHECK(Response::negotiateEncoding("") == Response::EncodingIdentity);
+    CHECK(Response::negotiateEncoding("gzip, deflate, br") == Response::EncodingGzip);
+    CHECK(Response::negotiateEncoding("deflate") == Response::EncodingDeflate);
+    CHECK(Response::negotiateEncoding("gzip;q=0.5, deflate") == Response::EncodingDeflate);
+    CHECK(Response::negotiateEncoding("GZIP;q=0, *") == Response::EncodingDeflate);
+    CHECK(Response::negotiateEncoding("br, identity") == Response::EncodingIdentity);
+    CHECK(Response::negotiateEncoding("*;q=0") == Response::EncodingIdentity);
+
+    CHECK(Response::encodingQuality("br;q=0.8, gzip", "br") == 0.8);
+    CHECK(Response::encodingQuality("x-gzip", "gzip") == 1);
+    CHECK(Response::encodingQuality("*;q=0.5", "br") == 0.5);
+    CHECK(Response::encodingQuality("gzip", "br") == -1);
+}
+
+TEST_CASE("Content-Length body is compressed when complete", "[response][compression]") {
+    std::string body(2000, 'a');
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+
+    Response::Writer w(fds[1]);
+    w.setEncoding(Response::EncodingGzip);
+    REQUIRE(w.writeStatusLine(Response::StatusOk));
+    REQUIRE(w.writeHeaders(Response::getDefaultHeaders(static_cast<int>(body.size()))));
+    REQUIRE(w.writeBody(body.data(), 1000));
+    CHECK(pipeIsEmpty(fds[0]));
+    REQUIRE(w.writeBody(body.data() + 1000, 1000));
+    close(fds[1]);
+
+    std::string output = readAll(fds[0]);
+    close(fds[0]);
+
+    size_t end = output.find("\r\n\r\n");
+    REQUIRE(end != std::string::npos);
+    std::string head = output.substr(0, end + 2);
+    std::string payload = output.substr(end + 4);
+    CHECK(head.find("content-encoding: gzip\r\n") != std::string::npos);
+    CHECK(head.find("vary: Accept-Encoding\r\n") != std::string::npos);
+    std::ostringstream len;
+    len << "content-length: " << payload.size() << "\r\n";
+    CHECK(head.find(len.str()) != std::string::npos);
+    CHECK(inflateAll(payload) == body);
+}
+
+TEST_CASE("Chunked body is compressed as a stream", "[response][compression]") {
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+
+    Headers h;
+    h.set("Transfer-Encoding", "chunked");
+    Response::Writer w(fds[1]);
+    w.setEncoding(Response::EncodingDeflate);
+    REQUIRE(w.writeStatusLine(Response::StatusOk));
+    REQUIRE(w.writeHeaders(h));
+    REQUIRE(w.writeChunkedBody("hello ", 6));
+    REQUIRE(w.writeChunkedBody("hello ", 6));
+    REQUIRE(w.writeChunkedBody("world", 5));
+    REQUIRE(w.writeChunkedBodyDone());
+    close(fds[1]);
+
+    std::string output = readAll(fds[0]);
+    close(fds[0]);
+
+    size_t end = output.find("\r\n\r\n");
+    REQUIRE(end != std::string::npos);
+    CHECK(output.substr(0, end).find("content-encoding: deflate") != std::string::npos);
+
+    // Reassemble the chunk payloads
+    std::string payload;
+    size_t pos = end + 4;
+    for (;;) {
+        size_t crlf = output.find("\r\n", pos);
+        REQUIRE(crlf != std::string::npos);
+        unsigned long n = std::strtoul(output.substr(pos, crlf - pos).c_str(), NULL, 16);
+        if (n == 0) {
+            break;
+        }
+        payload.append(output, crlf + 2, n);
+        pos = crlf + 2 + n + 2;
+    }
+    CHECK(inflateAll(payload) == "hello hello world");
+}
+
+TEST_CASE("Prepared keeps one compressed variant per coding", "[response][compression]") {
+    std::string body(1000, 'z');
+    Response::Prepared p(Response::StatusOk, Headers(), body.data(), body.size());
+    Response::Prepared tiny(Response::StatusOk, Headers(), "x", 1);
+
+    const Response::Prepared& gz = p.variant(Response::EncodingGzip);
+    CHECK(&gz != &p);
+    CHECK(&p.variant(Response::EncodingGzip) == &gz);
+    CHECK(&p.variant(Response::EncodingIdentity) == &p);
+    std::string data(gz.data().data(), gz.data().size());
+    CHECK(data.find("content-encoding: gzip\r\n") != std::string::npos);
+    CHECK(inflateAll(data.substr(gz.slot() + 2)) == body);
+
+    CHECK(&tiny.variant(Response::EncodingGzip) == &tiny);
+    // Whichever variant is sent, it names the header it was chosen by
+    std::string tinyData(tiny.data().data(), tiny.data().size());
+    CHECK(tinyData.find("vary: Accept-Encoding\r\n") != std::string::npos);
+    CHECK(data.find("vary: Accept-Encoding\r\n") != std::string::npos);
+}
+
+TEST_CASE("A file body sends headers held for compression as they are", "[response][compression]") {
+    char name[] = "/tmp/response_test_XXXXXX";
+    int file = mkstemp(name);
+    REQUIRE(file >= 0);
+    unlink(name);
+    REQUIRE(write(file, "abc", 3) == 3);
+
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    Response::Writer w(fds[1]);
+    w.setEncoding(Response::EncodingGzip);
+    REQUIRE(w.writeStatusLine(Response::StatusOk));
+    REQUIRE(w.writeHeaders(Response::getDefaultHeaders(3)));
+    REQUIRE(w.writeFile(file, 0, 3));
+    close(file);
+    close(fds[1]);
+
+    std::string output = readAll(fds[0]);
+    close(fds[0]);
+    CHECK(output.find("content-length: 3\r\n") != std::string::npos);
+    CHECK(output.find("content-encoding") == std::string::npos);
+    CHECK(output.substr(output.size() - 7) == "\r\n\r\nabc");
+}
+
+TEST_CASE("Buffer copies share one block", "[response][buffer]") {
+    Response::Buffer a("shared", 6);
+    Response::Buffer b = a;
+    CHECK(b.data() == a.data());
+    CHECK(a.storage()->refs == 2);
+    {
+        Response::Buffer c(b);
+        CHECK(a.storage()->refs == 3);
+    }
+    CHECK(a.storage()->refs == 2);
+    CHECK(Response::Buffer::wrap("static", 6).storage() == NULL);
+}
+
+TEST_CASE("BufferChain writes memory and file slices in order", "[response][buffer]") {
+    int file = tempFileWith("0123456789");
+    REQUIRE(file >= 0);
+
+    Response::Buffer body("body", 4);
+    Response::BufferChain chain;
+    chain.appendCopy("he", 2);
+    chain.appendCopy("ad ", 3);
+    chain.append(body, 1, 2);
+    REQUIRE(chain.appendFile(file, 3, 4));
+    close(file);
+    chain.append(Response::Buffer::wrap(" end", 4), 0, 4);
+
+    CHECK(chain.size() == 15);
+    CHECK(chain.hasFile());
+    struct iovec iov[8];
+    CHECK(chain.gather(iov, 8) == -1);
+    CHECK(body.storage()->refs == 2);
+
+    int sv[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    CHECK(chain.writeTo(sv[0], 7) == 7);
+    CHECK(chain.writeTo(sv[0], static_cast<size_t>(-1)) == 8);
+    CHECK(chain.empty());
+    CHECK(body.storage()->refs == 1);
+    close(sv[0]);
+
+    CHECK(readAll(sv[1]) == "head od3456 end");
+    close(sv[1]);
+}
+
+TEST_CASE("pump streams a body source without blocking", "[response][stream]") {
+    std::string body(1 << 20, 'v');
+    int file = tempFileWith(body);
+    REQUIRE(file >= 0);
+    REQUIRE(lseek(file, 0, SEEK_SET) == 0);
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    Response::Writer w(fds[1]);
+    w.setNonBlocking();
+    REQUIRE(w.writeStatusLine(Response::StatusOk));
+    REQUIRE(w.writeHeaders(Headers()));
+    w.stream(new Response::FdSource(file, true));
+
+    // Nobody reads the other end yet, so the socket fills up
+    CHECK(w.pump() == Response::Writer::WantWrite);
+
+    std::string output;
+    char buf[65536];
+    Response::Writer::Progress progress = Response::Writer::WantWrite;
+    while (progress == Response::Writer::WantWrite) {
+        ssize_t n = read(fds[0], buf, sizeof(buf));
+        REQUIRE(n > 0);
+        output.append(buf, n);
+        progress = w.pump();
+    }
+    CHECK(progress == Response::Writer::Done);
+    close(fds[1]);
+    output += readAll(fds[0]);
+    close(fds[0]);
+
+    CHECK(output == "HTTP/1.1 200 OK\r\n\r\n" + body);
+}
+
+TEST_CASE("pump stops at its write quota", "[response][stream]") {
+    std::string body(100000, 'q');
+    int file = tempFileWith(body);
+    REQUIRE(file >= 0);
+    REQUIRE(lseek(file, 0, SEEK_SET) == 0);
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    int size = 1 << 20;
+    setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    Response::Writer w(fds[1]);
+    w.setNonBlocking();
+    REQUIRE(w.writeStatusLine(Response::StatusOk));
+    REQUIRE(w.writeHeaders(Headers()));
+    w.stream(new Response::FdSource(file, true));
+
+    std::string head = "HTTP/1.1 200 OK\r\n\r\n";
+    size_t total = head.size() + body.size();
+    size_t sent = 0;
+    Response::Writer::Progress progress = Response::Writer::Yield;
+    while (progress == Response::Writer::Yield) {
+        size_t quota = 1000;
+        progress = w.pump(quota);
+        sent += 1000 - quota;
+        CHECK(sent <= total);
+    }
+    CHECK(progress == Response::Writer::Done);
+    CHECK(sent == total);
+    close(fds[1]);
+
+    CHECK(readAll(fds[0]) == head + body);
+    close(fds[0]);
+}
+
+static struct timespec at(long ms) {
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    return ts;
+}
+
+TEST_CASE("TokenBucket refills at its rate up to the burst", "[response][ratelimit]") {
+    Response::TokenBucket bucket(1000, 500, at(0));
+    CHECK(bucket.available(at(0)) == 500);
+    bucket.consume(500);
+    CHECK(bucket.available(at(0)) == 0);
+    CHECK(bucket.delayMs(100) >= 100);
+    CHECK(bucket.available(at(250)) == 250);
+    CHECK(bucket.delayMs(100) == 0);
+    CHECK(bucket.available(at(10000)) == 500);
+    // Requests above the burst wait only for a full bucket
+    bucket.consume(500);
+    CHECK(bucket.delayMs(100000) <= 501);
+}
+
+TEST_CASE("pump returns Paced when the rate limit runs out", "[response][ratelimit]") {
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    int src[2];
+    REQUIRE(pipe(src) == 0);
+    std::string body(4000, 'r');
+    REQUIRE(write(src[1], body.data(), body.size()) == static_cast<ssize_t>(body.size()));
+    close(src[1]);
+
+    Response::Writer w(fds[1]);
+    w.setNonBlocking();
+    w.setRateLimit(1000, 1000);
+    w.stream(new Response::FdSource(src[0], true));
+
+    size_t quota = 100000;
+    CHECK(w.pump(quota) == Response::Writer::Paced);
+    CHECK(quota == 99000);
+    CHECK(w.pacingDelayMs() > 0);
+    close(fds[1]);
+    CHECK(readAll(fds[0]) == std::string(1000, 'r'));
+    close(fds[0]);
+}
+
+TEST_CASE("A zero burst still paces instead of spinning", "[response][ratelimit]") {
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    int src[2];
+    REQUIRE(pipe(src) == 0);
+    REQUIRE(write(src[1], "abc", 3) == 3);
+    close(src[1]);
+
+    Response::Writer w(fds[1]);
+    w.setNonBlocking();
+    w.setRateLimit(1000, 0);
+    w.stream(new Response::FdSource(src[0], true));
+
+    size_t quota = 100000;
+    CHECK(w.pump(quota) == Response::Writer::Paced);
+    CHECK(w.pacingDelayMs() > 0);
+    close(fds[1]);
+    CHECK(readAll(fds[0]) == "a");
+    close(fds[0]);
+}
+
+// Connected TCP pair over loopback; SO_ZEROCOPY needs a real socket
+static bool tcpPair(int fds[2]) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        return false;
+    }
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    bool ok = bind(listener, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0
+              && listen(listener, 1) == 0
+              && getsockname(listener, reinterpret_cast<struct sockaddr*>(&addr), &len) == 0;
+    fds[0] = ok ? socket(AF_INET, SOCK_STREAM, 0) : -1;
+    ok = ok && fds[0] >= 0
+         && connect(fds[0], reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0;
+    fds[1] = ok ? accept(listener, NULL, NULL) : -1;
+    close(listener);
+    return fds[1] >= 0;
+}
+
+TEST_CASE("Zero-copy bodies are held until the kernel completes them", "[response][zerocopy]") {
+    int fds[2];
+    REQUIRE(tcpPair(fds));
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    std::string body(200000, 'z');
+    Response::Buffer shared(body.data(), body.size());
+
+    Response::Writer w(fds[1]);
+    w.setNonBlocking();
+    REQUIRE(w.setZeroCopy(64 * 1024));
+    REQUIRE(w.writeStatusLine(Response::StatusOk));
+    REQUIRE(w.writeHeaders(Headers()));
+    REQUIRE(w.writeBody(shared));
+
+    std::string output;
+    char buf[65536];
+    Response::Writer::Progress progress = w.pump();
+    while (progress != Response::Writer::Done) {
+        REQUIRE(progress != Response::Writer::Broken);
+        ssize_t n = recv(fds[0], buf, sizeof(buf), MSG_DONTWAIT);
+        if (n > 0) {
+            output.append(buf, n);
+        } else {
+            usleep(1000);
+        }
+        progress = w.pump();
+    }
+    CHECK(shared.storage()->refs == 1);
+    close(fds[1]);
+    output += readAll(fds[0]);
+    close(fds[0]);
+    CHECK(output == "HTTP/1.1 200 OK\r\n\r\n" + body);
+
+    // Unix sockets cannot do it
+    int sv[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    Response::Writer local(sv[0]);
+    CHECK_FALSE(local.setZeroCopy(1));
+    close(sv[0]);
+    close(sv[1]);
+}
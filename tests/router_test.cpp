@@ -0,0 +1,669 @@
+#include <catch2/catch_test_macros.hpp>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "Router.hpp"
+#include "Request.hpp"
+#include "PerfectHash.hpp"
+#include "RouteTable.hpp"
+#include "VirtualHosts.hpp"
+#include "ResponseCache.hpp"
+
+struct NamedHandler : public RouteHandler {
+    std::string name;
+    NamedHandler(const std::string& n) : name(n) {}
+    void handle(Response::Writer&, const Request&) {}
+};
+
+static std::string routed(const Router& r, const std::string& method, const std::string& target) {
+    RouteHandler* h = r.find(method, target);
+    return h != NULL ? static_cast<NamedHandler*>(h)->name : "default";
+}
+
+TEST_CASE("Exact routes beat prefixes and the longest prefix wins", "[router]") {
+    NamedHandler api("api"), v1("v1"), users("users"), root("root");
+    Router r;
+    // Registration order must not matter
+    r.prefix("/api/", api);
+    r.get("/api/v1/users", users);
+    r.prefix("/api/v1", v1);
+
+    CHECK(routed(r, "GET", "/api/v1/users") == "users");
+    CHECK(routed(r, "GET", "/api/v1/users/7") == "v1");
+    CHECK(routed(r, "GET", "/api/v1") == "v1");
+    CHECK(routed(r, "GET", "/api/v2/users") == "api");
+    CHECK(routed(r, "GET", "/api") == "api");
+    CHECK(routed(r, "GET", "/other") == "default");
+
+    r.prefix("/", root);
+    CHECK(routed(r, "GET", "/other") == "root");
+    CHECK(routed(r, "GET", "*") == "root");
+}
+
+TEST_CASE("Prefix routes match whole segments", "[router]") {
+    NamedHandler bin("bin");
+    Router r;
+    r.prefix("/httpbin/", bin);
+
+    CHECK(routed(r, "GET", "/httpbin/stream/5") == "bin");
+    CHECK(routed(r, "POST", "/httpbin/") == "bin");
+    CHECK(routed(r, "GET", "/httpbin") == "bin");
+    CHECK(routed(r, "GET", "/httpbinx") == "default");
+}
+
+TEST_CASE("Compressed nodes split when routes diverge", "[router]") {
+    NamedHandler abc("abc"), ab("ab"), ax("ax"), slash("slash"), home("home");
+    Router r;
+    r.get("/a/b/c", abc);
+    r.get("/a/b", ab);
+    r.get("/a/x", ax);
+    r.get("/a/b/", slash);
+    r.get("/", home);
+
+    CHECK(routed(r, "GET", "/a/b/c") == "abc");
+    CHECK(routed(r, "GET", "/a/b") == "ab");
+    CHECK(routed(r, "GET", "/a/x") == "ax");
+    CHECK(routed(r, "GET", "/a/b/") == "slash");
+    CHECK(routed(r, "GET", "/") == "home");
+    CHECK(routed(r, "GET", "/a") == "default");
+    CHECK(routed(r, "GET", "/a/b/c/d") == "default");
+    // The query is not part of the path
+    CHECK(routed(r, "GET", "/a/b?c=1") == "ab");
+}
+
+TEST_CASE("GET routes fall back to a prefix for other methods", "[router]") {
+    NamedHandler page("page"), any("any");
+    Router r;
+    r.get("/page", page);
+    r.prefix("/", any);
+
+    CHECK(routed(r, "GET", "/page") == "page");
+    CHECK(routed(r, "POST", "/page") == "any");
+}
+
+static std::string readAll(int fd) {
+    std::string out;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        out.append(buf, n);
+    }
+    return out;
+}
+
+static Request* makeRequest(const std::string& method, const std::string& target,
+                            const std::string& headers = "Host: localhost\r\n") {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        return NULL;
+    }
+    std::string data = method + " " + target + " HTTP/1.1\r\n" + headers + "\r\n";
+    ssize_t written = write(fds[1], data.data(), data.size());
+    close(fds[1]);
+    std::string err;
+    Request* req = written < 0 ? NULL : Request::requestFromSocket(fds[0], err);
+    close(fds[0]);
+    return req;
+}
+
+// Records what the router bound
+struct ParamHandler : public RouteHandler {
+    std::string name;
+    std::string seen;
+    ParamHandler(const std::string& n) : name(n) {}
+    void handle(Response::Writer&, const Request& req) {
+        seen = name;
+        for (size_t i = 0; i < req.paramCount(); i++) {
+            seen += std::string(" ") + req.paramAt(i).name + "=" + req.paramAt(i).value.str();
+        }
+    }
+};
+
+static std::string dispatch(Router& r, ParamHandler& h, const std::string& target) {
+    Request* req = makeRequest("GET", target);
+    if (req == NULL) {
+        return "no request";
+    }
+    Response::Writer w(-1);
+    h.seen = "default";
+    r.handle(w, *req);
+    delete req;
+    return h.seen;
+}
+
+TEST_CASE("Path parameters and wildcards are bound as views", "[router][params]") {
+    ParamHandler h("h");
+    Router r;
+    r.get("/users/:id/posts/*", h);
+    r.get("/users/:id", h);
+    r.get("/users/me", h);
+    r.get("/files/:dir/:name", h);
+
+    CHECK(dispatch(r, h, "/users/42") == "h id=42");
+    CHECK(dispatch(r, h, "/users/me") == "h");
+    CHECK(dispatch(r, h, "/users/42/posts/2024/hello?draft=1") == "h id=42 *=2024/hello");
+    CHECK(dispatch(r, h, "/users/42/posts") == "h id=42 *=");
+    CHECK(dispatch(r, h, "/files/docs/readme") == "h dir=docs name=readme");
+    CHECK(dispatch(r, h, "/files/docs") == "default");
+
+    Request* req = makeRequest("GET", "/users/7/posts/x");
+    REQUIRE(req != NULL);
+    Response::Writer w(-1);
+    r.handle(w, *req);
+    CHECK(req->param("id") == "7");
+    CHECK(req->param("id").data() == req->getTarget().data() + 7);
+    CHECK(req->param("missing").empty());
+    delete req;
+}
+
+TEST_CASE("Static segments are tried before parameters, with backtracking", "[router][params]") {
+    ParamHandler h("h");
+    Router r;
+    r.get("/a/static/x", h);
+    r.get("/a/:p/y", h);
+
+    CHECK(dispatch(r, h, "/a/static/x") == "h");
+    // The static branch dead-ends, so the parameter branch is used
+    CHECK(dispatch(r, h, "/a/static/y") == "h p=static");
+}
+
+static void sendHello(Response::Writer& w, const Request&) {
+    w.writeStatusLine(Response::StatusOk);
+    w.writeHeaders(Response::getDefaultHeaders(5));
+    w.writeBody("hello", 5);
+}
+
+// The raw response the router produces for a request
+static std::string respond(Router& r, const std::string& method, const std::string& target) {
+    Request* req = makeRequest(method, target);
+    int fds[2];
+    if (req == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        delete req;
+        return "";
+    }
+    {
+        Response::Writer w(fds[1]);
+        r.handle(w, *req);
+        w.flush();
+    }
+    close(fds[1]);
+    std::string out = readAll(fds[0]);
+    close(fds[0]);
+    delete req;
+    return out;
+}
+
+TEST_CASE("Routes are indexed by method, including custom ones", "[router][methods]") {
+    NamedHandler get("get"), post("post"), del("delete"), purge("purge");
+    Router r;
+    r.get("/item", get);
+    r.post("/item", post);
+    r.del("/item", del);
+    r.route("PURGE", "/item", purge);
+
+    CHECK(routed(r, "GET", "/item") == "get");
+    CHECK(routed(r, "POST", "/item") == "post");
+    CHECK(routed(r, "DELETE", "/item") == "delete");
+    CHECK(routed(r, "PURGE", "/item") == "purge");
+    CHECK(routed(r, "HEAD", "/item") == "get");
+    CHECK(routed(r, "PUT", "/item") == "default");
+}
+
+TEST_CASE("HEAD is answered by GET without a body", "[router][methods]") {
+    Router r;
+    r.get("/hello", sendHello);
+
+    CHECK(respond(r, "GET", "/hello").find("\r\n\r\nhello") != std::string::npos);
+    std::string head = respond(r, "HEAD", "/hello");
+    CHECK(head.find("HTTP/1.1 200 OK\r\n") == 0);
+    CHECK(head.find("content-length: 5\r\n") != std::string::npos);
+    CHECK(head.substr(head.size() - 4) == "\r\n\r\n");
+}
+
+TEST_CASE("Unregistered methods get 405 and OPTIONS gets Allow", "[router][methods]") {
+    Router r;
+    r.get("/hello", sendHello);
+    r.put("/hello", sendHello);
+    r.route("PURGE", "/hello", sendHello);
+
+    std::string resp = respond(r, "POST", "/hello");
+    CHECK(resp.find("HTTP/1.1 405 Method Not Allowed\r\n") == 0);
+    CHECK(resp.find("allow: GET, HEAD, PUT, OPTIONS, PURGE\r\n") != std::string::npos);
+
+    resp = respond(r, "OPTIONS", "/hello");
+    CHECK(resp.find("HTTP/1.1 204 No Content\r\n") == 0);
+    CHECK(resp.find("allow: GET, HEAD, PUT, OPTIONS, PURGE\r\n") != std::string::npos);
+
+    // Unknown paths still go to the default handler
+    CHECK(respond(r, "POST", "/other").empty());
+}
+
+TEST_CASE("A perfect hash finds every key and nothing else", "[router][freeze]") {
+    std::vector<std::string> keys;
+    for (int i = 0; i < 1000; i++) {
+        keys.push_back("/route/" + std::string(1, static_cast<char>('a' + i % 26)) +
+                       std::string(static_cast<size_t>(i / 26), 'x'));
+    }
+    PerfectHash ph;
+    REQUIRE(ph.build(keys));
+    for (size_t i = 0; i < keys.size(); i++) {
+        CHECK(ph.find(keys[i].data(), keys[i].size()) == static_cast<int>(i));
+    }
+    CHECK(ph.find("/route/", 7) == -1);
+    CHECK(ph.find("/nope", 5) == -1);
+    // As long as a key, or longer than any
+    CHECK(ph.find("/route/A", 8) == -1);
+    std::string longer = keys.back() + "x";
+    CHECK(ph.find(longer.data(), longer.size()) == -1);
+
+    // A rebuild forgets the old keys
+    std::vector<std::string> other(1, "/other");
+    REQUIRE(ph.build(other));
+    CHECK(ph.find("/other", 6) == 0);
+    CHECK(ph.find(keys[0].data(), keys[0].size()) == -1);
+
+    PerfectHash empty;
+    REQUIRE(empty.build(std::vector<std::string>()));
+    CHECK(empty.find("/", 1) == -1);
+}
+
+TEST_CASE("A rate limit needs room for a burst", "[router][ratelimit]") {
+    NamedHandler page("page");
+    Router r;
+    r.get("/a", page);
+    CHECK_FALSE(r.limit("/a", 1024, 0));
+    CHECK(r.limit("/a", 1024, 1));
+    CHECK(r.limit("/a", 0, 0));
+}
+
+TEST_CASE("A rate limit on an unregistered path is rejected", "[router][ratelimit]") {
+    NamedHandler video("video");
+    Router r;
+    r.get("/video", video);
+    CHECK_FALSE(r.limit("/vidoe", 1024, 1024));
+    CHECK(r.limit("/video", 1024, 1024));
+}
+
+TEST_CASE("A frozen router routes the same and rejects registration", "[router][freeze]") {
+    NamedHandler page("page"), post("post"), any("any"), item("item"), late("late");
+    Router r;
+    r.get("/", page);
+    r.get("/a/b", page);
+    r.post("/a/b", post);
+    r.get("/a/:id", item);
+    r.prefix("/a/", any);
+    REQUIRE(r.freeze());
+    CHECK(r.isFrozen());
+
+    CHECK(routed(r, "GET", "/") == "page");
+    CHECK(routed(r, "GET", "/a/b?x=1") == "page");
+    CHECK(routed(r, "HEAD", "/a/b") == "page");
+    CHECK(routed(r, "POST", "/a/b") == "post");
+    // Misses in the hash still reach parameters and prefixes
+    CHECK(routed(r, "PUT", "/a/b") == "any");
+    CHECK(routed(r, "GET", "/a/7") == "item");
+    CHECK(routed(r, "GET", "/a/b/c") == "any");
+    CHECK(routed(r, "GET", "/b") == "default");
+
+    CHECK_FALSE(r.get("/late", late));
+    CHECK_FALSE(r.prefix("/late/", late));
+    CHECK_FALSE(r.setDefault(late));
+    CHECK_FALSE(r.limit("/a/b", 1024, 1024));
+    CHECK(routed(r, "GET", "/late") == "default");
+}
+
+static Router* frozenRouter(RouteHandler& h) {
+    Router* r = new Router;
+    r->get("/page", h);
+    r->freeze();
+    return r;
+}
+
+TEST_CASE("A route table swaps in frozen routers", "[router][routetable]") {
+    NamedHandler one("one"), two("two");
+    RouteTable table;
+    CHECK(table.snapshot() == NULL);
+
+    Router unfrozen;
+    CHECK_FALSE(table.publish(&unfrozen));
+    CHECK_FALSE(table.publish(NULL));
+
+    REQUIRE(table.publish(frozenRouter(one)));
+    CHECK(routed(*table.snapshot(), "GET", "/page") == "one");
+
+    // This thread is still reading the first router
+    REQUIRE(table.publish(frozenRouter(two)));
+    CHECK(table.retiredCount() == 1);
+    table.quiescent();
+    CHECK(table.retiredCount() == 0);
+    CHECK(routed(*table.snapshot(), "GET", "/page") == "two");
+}
+
+struct ReaderThread {
+    RouteTable* table;
+    volatile int step; // advanced by the test, acknowledged by the thread
+    volatile int done;
+};
+
+static void waitFor(volatile int& v, int value) {
+    while (v < value) {
+        usleep(100);
+    }
+}
+
+static void* readRoutes(void* arg) {
+    ReaderThread* t = static_cast<ReaderThread*>(arg);
+    t->table->snapshot();
+    __sync_synchronize();
+    t->done = 1;
+    waitFor(t->step, 1);
+    t->table->quiescent();
+    __sync_synchronize();
+    t->done = 2;
+    waitFor(t->step, 2);
+    t->table->snapshot();
+    __sync_synchronize();
+    t->done = 3;
+    waitFor(t->step, 3);
+    t->table->offline();
+    __sync_synchronize();
+    t->done = 4;
+    return NULL;
+}
+
+TEST_CASE("Retired routers outlive readers that may still see them", "[router][routetable]") {
+    NamedHandler h("h");
+    RouteTable table;
+    REQUIRE(table.publish(frozenRouter(h)));
+
+    ReaderThread t;
+    t.table = &table;
+    t.step = 0;
+    t.done = 0;
+    pthread_t tid;
+    REQUIRE(pthread_create(&tid, NULL, readRoutes, &t) == 0);
+
+    waitFor(t.done, 1);
+    REQUIRE(table.publish(frozenRouter(h)));
+    CHECK(table.retiredCount() == 1);
+
+    t.step = 1;
+    waitFor(t.done, 2);
+    table.reclaim();
+    CHECK(table.retiredCount() == 0);
+
+    // An offline reader does not hold back reclamation
+    t.step = 2;
+    waitFor(t.done, 3);
+    REQUIRE(table.publish(frozenRouter(h)));
+    CHECK(table.retiredCount() == 1);
+    t.step = 3;
+    waitFor(t.done, 4);
+    table.reclaim();
+    CHECK(table.retiredCount() == 0);
+
+    pthread_join(tid, NULL);
+}
+
+static std::string trace;
+
+static bool traceGlobal(Response::Writer&, const Request&) {
+    trace += "global ";
+    return true;
+}
+
+static bool traceApi(Response::Writer&, const Request&) {
+    trace += "api ";
+    return true;
+}
+
+static bool traceUser(Response::Writer&, const Request& req) {
+    trace += "user:" + req.param("id").str() + " ";
+    return true;
+}
+
+static bool deny(Response::Writer& w, const Request&) {
+    trace += "deny ";
+    w.writeStatusLine(Response::StatusBadRequest);
+    w.writeHeaders(Response::getDefaultHeaders(0));
+    return false;
+}
+
+static void traceHandler(Response::Writer& w, const Request& req) {
+    trace += "handler";
+    sendHello(w, req);
+}
+
+static std::string traced(Router& r, const std::string& target) {
+    trace.clear();
+    respond(r, "GET", target);
+    return trace;
+}
+
+TEST_CASE("Middleware runs per route and per subtree once frozen", "[router][middleware]") {
+    Router r;
+    r.use(traceGlobal, "global");
+    r.use("/api/*", traceApi, "api");
+    r.use("/api/users/:id", traceUser, "user");
+    r.use("/api/private/*", deny, "deny");
+    r.get("/api/users/:id", traceHandler);
+    r.get("/api/other", traceHandler);
+    r.get("/api/private/x", traceHandler);
+    r.get("/home", traceHandler);
+
+    // Before freezing only global middleware runs
+    CHECK(traced(r, "/api/users/7") == "global handler");
+
+    REQUIRE(r.freeze());
+    r.setProfiling(true);
+    CHECK(traced(r, "/api/users/7") == "global api user:7 handler");
+    CHECK(traced(r, "/api/other") == "global api handler");
+    CHECK(traced(r, "/home") == "global handler");
+    CHECK(traced(r, "/nowhere") == "global ");
+    CHECK(traced(r, "/api/private/x") == "global api deny ");
+    CHECK_FALSE(r.use(traceApi));
+
+    std::vector<Router::StageStats> stats = r.stageStats();
+    REQUIRE(stats.size() == 4);
+    CHECK(stats[0].name == "global");
+    CHECK(stats[0].path == "");
+    CHECK(stats[0].calls == 5);
+    CHECK(stats[1].path == "/api/*");
+    CHECK(stats[1].calls == 3);
+    CHECK(stats[2].calls == 1);
+    CHECK(stats[3].calls == 1);
+}
+
+TEST_CASE("Middleware stays on its route when a later route splits the node", "[router][middleware]") {
+    Router r;
+    r.use("/a/b/*", traceApi, "ab");
+    r.use("/a/b/c", traceUser, "abc");
+    r.get("/a/b/c", traceHandler);
+    // Both split the /a/b/c node
+    r.get("/a/x", traceHandler);
+    r.get("/a", traceHandler);
+    REQUIRE(r.freeze());
+
+    CHECK(traced(r, "/a/b/c") == "api user: handler");
+    CHECK(traced(r, "/a") == "handler");
+    CHECK(traced(r, "/a/x") == "handler");
+}
+
+struct SiteHandler : public RequestHandler {
+    std::string name;
+    int quiesced;
+    SiteHandler(const std::string& n) : name(n), quiesced(0) {}
+    void handle(Response::Writer&, const Request&) {}
+    void quiescent() { quiesced++; }
+};
+
+static std::string site(const VirtualHosts& v, const std::string& host) {
+    RequestHandler* h = v.find(host);
+    return h != NULL ? static_cast<SiteHandler*>(h)->name : "none";
+}
+
+TEST_CASE("Virtual hosts dispatch on the normalized host", "[router][vhost]") {
+    SiteHandler api("api"), any("any"), deep("deep"), fallback("fallback");
+    VirtualHosts v;
+    REQUIRE(v.add("API.example.com", api));
+    REQUIRE(v.add("*.example.com", any));
+    REQUIRE(v.add("*.eu.example.com", deep));
+    CHECK_FALSE(v.add("api.example.com", fallback));
+    Router unfrozen;
+    CHECK_FALSE(v.add("unfrozen.test", unfrozen));
+
+    CHECK(site(v, "api.example.com") == "api");
+    CHECK(site(v, "www.example.com") == "any");
+    CHECK(site(v, "a.b.example.com") == "any");
+    CHECK(site(v, "cdn.eu.example.com") == "deep");
+    CHECK(site(v, "example.com") == "none");
+    CHECK(site(v, "other.test") == "none");
+
+    v.setDefault(fallback);
+    CHECK(site(v, "example.com") == "fallback");
+
+    // Unknown hosts without a default are misdirected
+    VirtualHosts bare;
+    REQUIRE(bare.add("example.com", api));
+    Request* req = makeRequest("GET", "/");
+    int fds[2];
+    REQUIRE(req != NULL);
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    {
+        Response::Writer w(fds[1]);
+        bare.handle(w, *req);
+    }
+    close(fds[1]);
+    CHECK(readAll(fds[0]).find("HTTP/1.1 421 Misdirected Request\r\n") == 0);
+    close(fds[0]);
+    delete req;
+
+    v.quiescent();
+    CHECK(api.quiesced == 1);
+    CHECK(any.quiesced == 1);
+    CHECK(fallback.quiesced == 1);
+}
+
+static int hotCalls = 0;
+
+static void hotHandler(Response::Writer& w, const Request& req) {
+    hotCalls++;
+    sendHello(w, req);
+}
+
+TEST_CASE("Cached routes run their handler once per key", "[router][cache]") {
+    ResponseCache cache(1 << 20);
+    Router r;
+    r.get("/hot", hotHandler);
+    r.post("/hot", hotHandler);
+    CHECK_FALSE(r.cache("/missing", cache, 60000, 0));
+    REQUIRE(r.cache("/hot", cache, 60000, 0));
+    REQUIRE(r.freeze());
+    hotCalls = 0;
+
+    std::string first = respond(r, "GET", "/hot?b=1&a=2");
+    CHECK(first.find("hello") != std::string::npos);
+    CHECK(respond(r, "GET", "/hot?a=2&b=1") == first);
+    CHECK(hotCalls == 1);
+    CHECK(cache.entries() == 1);
+
+    // HEAD has its own entry, without a body
+    std::string head = respond(r, "HEAD", "/hot");
+    CHECK(head.find("content-length: 5\r\n") != std::string::npos);
+    CHECK(head.find("hello") == std::string::npos);
+    CHECK(respond(r, "HEAD", "/hot") == head);
+    CHECK(hotCalls == 2);
+
+    respond(r, "POST", "/hot");
+    respond(r, "POST", "/hot");
+    CHECK(hotCalls == 4);
+}
+
+static const char CACHED_OK[] = "HTTP/1.1 200 OK\r\ncontent-length: 5\r\n\r\nhello";
+
+TEST_CASE("Cache entries go stale, then expire", "[router][cache]") {
+    ResponseCache cache(1 << 20);
+    Request* req = makeRequest("GET", "/page");
+    REQUIRE(req != NULL);
+    ResponseCache::Hit hit;
+
+    CHECK(cache.lookup(*req, 0, hit) == ResponseCache::Miss);
+    REQUIRE(cache.store(*req, CACHED_OK, 17, 0, 100, 100));
+    REQUIRE(cache.lookup(*req, 50, hit) == ResponseCache::Fresh);
+    CHECK(std::string(hit.data.data(), hit.data.size()) == CACHED_OK);
+    CHECK(hit.slot == 17);
+    CHECK_FALSE(hit.revalidate);
+
+    // One caller refreshes a stale entry; the rest are served stale
+    CHECK(cache.lookup(*req, 150, hit) == ResponseCache::Stale);
+    CHECK(hit.revalidate);
+    CHECK(cache.lookup(*req, 160, hit) == ResponseCache::Stale);
+    CHECK_FALSE(hit.revalidate);
+    REQUIRE(cache.store(*req, CACHED_OK, 17, 170, 100, 100));
+    CHECK(cache.lookup(*req, 180, hit) == ResponseCache::Fresh);
+    CHECK(cache.entries() == 1);
+
+    // A refresh that was not kept releases its claim
+    CHECK(cache.lookup(*req, 290, hit) == ResponseCache::Stale);
+    CHECK(hit.revalidate);
+    CHECK_FALSE(cache.store(*req, "HTTP/1.1 500 Internal Server Error\r\n\r\n", 17, 290, 100, 100));
+    cache.abandon(*req);
+    CHECK(cache.lookup(*req, 295, hit) == ResponseCache::Stale);
+    CHECK(hit.revalidate);
+
+    CHECK(cache.lookup(*req, 400, hit) == ResponseCache::Miss);
+
+    // Hosts never share entries
+    Request* other = makeRequest("GET", "/page", "Host: b.example.com\r\n");
+    REQUIRE(other != NULL);
+    REQUIRE(cache.store(*req, CACHED_OK, 17, 400, 100, 100));
+    CHECK(cache.lookup(*other, 410, hit) == ResponseCache::Miss);
+    delete other;
+
+    // Only plain 200 responses are kept
+    CHECK_FALSE(cache.store(*req, "HTTP/1.1 500 Internal Server Error\r\n\r\n", 17, 0, 100, 0));
+    CHECK_FALSE(cache.store(*req, "HTTP/1.1 200 OK\r\nset-cookie: a=b\r\n\r\n", 17, 0, 100, 0));
+    CHECK_FALSE(cache.store(*req, "HTTP/1.1 200 OK\r\ncache-control: no-store\r\n\r\n", 17, 0, 100, 0));
+    CHECK_FALSE(cache.store(*req, "HTTP/1.1 200 OK\r\nvary: *\r\n\r\n", 17, 0, 100, 0));
+    delete req;
+}
+
+TEST_CASE("The cache evicts least recently used entries and splits on Vary", "[router][cache]") {
+    std::string response = CACHED_OK;
+    size_t cost = response.size() + std::string("GET localhost/a").size();
+    ResponseCache cache(2 * cost, 4);
+    Request* a = makeRequest("GET", "/a");
+    Request* b = makeRequest("GET", "/b");
+    Request* c = makeRequest("GET", "/c");
+    REQUIRE(a != NULL);
+    REQUIRE(b != NULL);
+    REQUIRE(c != NULL);
+    ResponseCache::Hit hit;
+
+    REQUIRE(cache.store(*a, response, 17, 0, 1000, 0));
+    REQUIRE(cache.store(*b, response, 17, 1, 1000, 0));
+    CHECK(cache.lookup(*a, 2, hit) == ResponseCache::Fresh);
+    REQUIRE(cache.store(*c, response, 17, 3, 1000, 0));
+    CHECK(cache.entries() == 2);
+    CHECK(cache.bytes() == 2 * cost);
+    CHECK(cache.lookup(*a, 4, hit) == ResponseCache::Fresh);
+    CHECK(cache.lookup(*b, 4, hit) == ResponseCache::Miss);
+    CHECK(cache.lookup(*c, 4, hit) == ResponseCache::Fresh);
+
+    // The entry only answers requests with the same Host
+    ResponseCache varied(1 << 20);
+    REQUIRE(varied.store(*a, "HTTP/1.1 200 OK\r\nvary: Host\r\n\r\n", 17, 0, 1000, 0));
+    CHECK(varied.lookup(*a, 1, hit) == ResponseCache::Fresh);
+    Request* other = makeRequest("GET", "/a", "Host: example.com\r\n");
+    REQUIRE(other != NULL);
+    CHECK(varied.lookup(*other, 1, hit) == ResponseCache::Miss);
+    REQUIRE(varied.store(*other, "HTTP/1.1 200 OK\r\nvary: Host\r\n\r\n", 17, 1, 1000, 0));
+    CHECK(varied.entries() == 2);
+    delete other;
+    delete a;
+    delete b;
+    delete c;
+}
@@ -1,12 +1,15 @@
 #include <catch2/catch_test_macros.hpp>
 #include <string>
+#include <vector>
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
 #include <sstream>
+#include <ctime>
 #include <pthread.h>
 #include <csignal>
 #include <unistd.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -14,6 +17,9 @@
 #include "Router.hpp"
 #include "Request.hpp"
 #include "Server.hpp"
+#include "BodySource.hpp"
+#include "FileResponse.hpp"
+#include "StaticFileHandler.hpp"
 
 #define TEST_PORT 18080
 
@@ -97,16 +103,60 @@ static void handleChunked(Response::Writer& w, const Request&) {
     }
 }
 
+static const char PONG[] = "pong";
+static const Response::Prepared PREPARED_PONG(Response::StatusOk, Headers(), PONG, sizeof(PONG) - 1);
+
+// Write end of the pipe feeding the /slow response body
+static int slowWriteFd = -1;
+
+static void handleSlow(Response::Writer& w, const Request&) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return;
+    }
+    slowWriteFd = fds[1];
+    Headers h;
+    h.set("transfer-encoding", "chunked");
+    w.writeStatusLine(Response::StatusOk);
+    w.writeHeaders(h);
+    w.stream(new Response::FdSource(fds[0], true));
+}
+
+static const size_t PACED_SIZE = 48 * 1024;
+
+// Streams PACED_SIZE bytes; the route is rate limited
+static void handlePaced(Response::Writer& w, const Request&) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return;
+    }
+    std::string body(PACED_SIZE, 'p');
+    if (write(fds[1], body.data(), body.size()) != static_cast<ssize_t>(body.size())) {
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    close(fds[1]);
+    std::ostringstream len;
+    len << PACED_SIZE;
+    Headers h;
+    h.set("content-length", len.str());
+    w.writeStatusLine(Response::StatusOk);
+    w.writeHeaders(h);
+    w.stream(new Response::FdSource(fds[0], true));
+}
+
 static void* serverThread(void* arg) {
     Server* s = static_cast<Server*>(arg);
     s->run();
     return NULL;
 }
 
-static std::string sendRequest(uint16_t port, const std::string& path) {
+static int openRequest(uint16_t port, const std::string& path,
+                       const std::string& headers = "") {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
-        return "";
+        return -1;
     }
 
     struct sockaddr_in addr;
@@ -117,20 +167,23 @@ static std::string sendRequest(uint16_t port, const std::string& path) {
 
     if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
         close(fd);
-        return "";
+        return -1;
     }
 
     std::string request = "GET " + path + " HTTP/1.1\r\n"
                           "Host: localhost\r\n"
                           "Connection: close\r\n"
-                          "\r\n";
+                          + headers + "\r\n";
 
     ssize_t written = write(fd, request.c_str(), request.size());
     if (written < 0) {
         close(fd);
-        return "";
+        return -1;
     }
+    return fd;
+}
 
+static std::string readResponse(int fd) {
     std::string response;
     char buf[4096];
     for (;;) {
@@ -145,6 +198,64 @@ static std::string sendRequest(uint16_t port, const std::string& path) {
     return response;
 }
 
+static std::string sendRequest(uint16_t port, const std::string& path,
+                               const std::string& headers = "") {
+    int fd = openRequest(port, path, headers);
+    if (fd < 0) {
+        return "";
+    }
+    return readResponse(fd);
+}
+
+// Sends a file written by the test, from the loop; the route is rate limited
+static int streamedFileFd = -1;
+static const size_t STREAMED_FILE_SIZE = 64 * 1024;
+
+static void handleFile(Response::Writer& w, const Request&) {
+    std::ostringstream len;
+    len << STREAMED_FILE_SIZE;
+    Headers h;
+    h.set("content-length", len.str());
+    w.writeStatusLine(Response::StatusOk);
+    w.writeHeaders(h);
+    w.streamFile(streamedFileFd, 0, STREAMED_FILE_SIZE);
+}
+
+// The same file with Range support
+static void handleRange(Response::Writer& w, const Request& req) {
+    Headers h;
+    h.set("content-type", "text/plain");
+    h.set("last-modified", "Sun, 18 Oct 2026 10:00:00 GMT");
+    FileResponse::send(w, req, streamedFileFd, STREAMED_FILE_SIZE, h);
+}
+
+// Set by the static file test before it starts the server
+static StaticFileHandler* staticFiles = NULL;
+
+// Names one file of staticFiles itself, as /video does
+struct OneFile : public RouteHandler {
+    void handle(Response::Writer& w, const Request& req) { staticFiles->serve(w, req, "a.txt"); }
+};
+static OneFile oneFile;
+
+// Fills streamedFileFd with STREAMED_FILE_SIZE bytes of a-z and returns them
+static std::string makeStreamedFile() {
+    char name[] = "/tmp/server_test_XXXXXX";
+    streamedFileFd = mkstemp(name);
+    if (streamedFileFd < 0) {
+        return "";
+    }
+    unlink(name);
+    std::string body;
+    for (size_t i = 0; i < STREAMED_FILE_SIZE; i++) {
+        body += static_cast<char>('a' + i % 26);
+    }
+    if (write(streamedFileFd, body.data(), body.size()) != static_cast<ssize_t>(body.size())) {
+        return "";
+    }
+    return body;
+}
+
 // RAII wrapper: starts the server in a pthread, tears it down via SIGTERM.
 struct ServerGuard {
     Server* s;
@@ -155,6 +266,17 @@ struct ServerGuard {
         router.get("/yourproblem", handle400);
         router.get("/myproblem", handle500);
         router.get("/chunked", handleChunked);
+        router.get("/ping", PREPARED_PONG);
+        router.get("/slow", handleSlow);
+        router.get("/paced", handlePaced);
+        router.limit("/paced", 256 * 1024, 16 * 1024);
+        router.get("/file", handleFile);
+        router.limit("/file", 256 * 1024, 16 * 1024);
+        router.get("/range", handleRange);
+        if (staticFiles != NULL) {
+            router.get("/static/*", *staticFiles);
+            router.get("/one", oneFile);
+        }
         router.setDefault(handleDefault);
 
         // Block SIGINT/SIGTERM so only the server's signalfd picks them up.
@@ -261,3 +383,396 @@ TEST_CASE("GET /chunked returns chunked transfer encoding", "[server]") {
     std::string decoded = decodeChunked(body);
     CHECK(decoded == "Hello, chunked world!");
 }
+
+TEST_CASE("GET /ping serves a prepared response", "[server]") {
+    ServerGuard server;
+    REQUIRE(server.s != NULL);
+
+    std::string resp = sendRequest(TEST_PORT, "/ping");
+    REQUIRE_FALSE(resp.empty());
+
+    CHECK(resp.find("HTTP/1.1 200 OK\r\n") != std::string::npos);
+    CHECK(resp.find("content-length: 4\r\n") != std::string::npos);
+    CHECK(resp.find(" GMT\r\nserver: httpfromtcp\r\n") != std::string::npos);
+    CHECK(resp.substr(resp.size() - 8) == "\r\n\r\npong");
+}
+
+TEST_CASE("A pending streamed body does not block other requests", "[server][stream]") {
+    ServerGuard server;
+    REQUIRE(server.s != NULL);
+
+    slowWriteFd = -1;
+    int slow = openRequest(TEST_PORT, "/slow");
+    REQUIRE(slow >= 0);
+    usleep(50000);
+    REQUIRE(slowWriteFd >= 0);
+
+    std::string ping = sendRequest(TEST_PORT, "/ping");
+    CHECK(ping.find("pong") != std::string::npos);
+
+    REQUIRE(write(slowWriteFd, "late", 4) == 4);
+    close(slowWriteFd);
+
+    std::string resp = readResponse(slow);
+    size_t bodyStart = resp.find("\r\n\r\n");
+    REQUIRE(bodyStart != std::string::npos);
+    CHECK(resp.substr(bodyStart + 4) == "4\r\nlate\r\n0\r\n\r\n");
+}
+
+TEST_CASE("A rate-limited route is paced by the loop", "[server][ratelimit]") {
+    ServerGuard server;
+    REQUIRE(server.s != NULL);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int paced = openRequest(TEST_PORT, "/paced");
+    REQUIRE(paced >= 0);
+
+    // Other requests are served while it waits
+    CHECK(sendRequest(TEST_PORT, "/ping").find("pong") != std::string::npos);
+
+    std::string resp = readResponse(paced);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long elapsedMs = (end.tv_sec - start.tv_sec) * 1000
+                     + (end.tv_nsec - start.tv_nsec) / 1000000;
+
+    size_t bodyStart = resp.find("\r\n\r\n");
+    REQUIRE(bodyStart != std::string::npos);
+    CHECK(resp.substr(bodyStart + 4) == std::string(PACED_SIZE, 'p'));
+    // 32 KiB beyond the burst at 256 KiB/s takes at least 125ms
+    CHECK(elapsedMs >= 120);
+}
+
+TEST_CASE("A streamed file is sent and paced by the loop", "[server][sendfile]") {
+    std::string body = makeStreamedFile();
+    REQUIRE(!body.empty());
+
+    ServerGuard server;
+    REQUIRE(server.s != NULL);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int file = openRequest(TEST_PORT, "/file");
+    REQUIRE(file >= 0);
+    CHECK(sendRequest(TEST_PORT, "/ping").find("pong") != std::string::npos);
+
+    std::string resp = readResponse(file);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long elapsedMs = (end.tv_sec - start.tv_sec) * 1000
+                     + (end.tv_nsec - start.tv_nsec) / 1000000;
+    close(streamedFileFd);
+
+    size_t bodyStart = resp.find("\r\n\r\n");
+    REQUIRE(bodyStart != std::string::npos);
+    CHECK(resp.find("content-length: 65536\r\n") != std::string::npos);
+    CHECK(resp.substr(bodyStart + 4) == body);
+    // 48 KiB beyond the burst at 256 KiB/s takes at least 187ms
+    CHECK(elapsedMs >= 180);
+}
+
+TEST_CASE("Range values are parsed against the body size", "[server][range]") {
+    std::vector<FileResponse::ByteRange> r;
+    CHECK(FileResponse::parseRange("bytes=0-99", 1000, r) == FileResponse::Partial);
+    REQUIRE(r.size() == 1);
+    CHECK((r[0].first == 0 && r[0].last == 99));
+
+    CHECK(FileResponse::parseRange("bytes=900-, 10-19, -50", 1000, r) == FileResponse::Partial);
+    REQUIRE(r.size() == 2);
+    CHECK((r[0].first == 10 && r[0].last == 19));
+    CHECK((r[1].first == 900 && r[1].last == 999));
+
+    // Overlapping, repeated and adjacent ranges are merged
+    CHECK(FileResponse::parseRange("bytes=0-,0-,0-,0-", 1000, r) == FileResponse::Partial);
+    REQUIRE(r.size() == 1);
+    CHECK((r[0].first == 0 && r[0].last == 999));
+    CHECK(FileResponse::parseRange("bytes=20-29, 0-9, 10-14, 25-40", 1000, r) == FileResponse::Partial);
+    REQUIRE(r.size() == 2);
+    CHECK((r[0].first == 0 && r[0].last == 14));
+    CHECK((r[1].first == 20 && r[1].last == 40));
+
+    // A suffix longer than the body is the whole body
+    CHECK(FileResponse::parseRange("bytes=-5000", 1000, r) == FileResponse::Partial);
+    CHECK((r[0].first == 0 && r[0].last == 999));
+
+    // Ranges past the end are dropped
+    CHECK(FileResponse::parseRange("bytes=1000-, 0-0", 1000, r) == FileResponse::Partial);
+    CHECK(r.size() == 1);
+    CHECK(FileResponse::parseRange("bytes=1000-2000", 1000, r) == FileResponse::Unsatisfiable);
+    CHECK(FileResponse::parseRange("bytes=-0", 1000, r) == FileResponse::Unsatisfiable);
+
+    // Malformed values are ignored
+    CHECK(FileResponse::parseRange("", 1000, r) == FileResponse::Whole);
+    CHECK(FileResponse::parseRange("items=0-1", 1000, r) == FileResponse::Whole);
+    CHECK(FileResponse::parseRange("bytes=5-1", 1000, r) == FileResponse::Whole);
+    CHECK(FileResponse::parseRange("bytes=a-b", 1000, r) == FileResponse::Whole);
+    CHECK(FileResponse::parseRange("bytes=-", 1000, r) == FileResponse::Whole);
+    CHECK(FileResponse::parseRange("bytes=0-1,2-3,4-5,6-7,8-9,10-11,12-13,14-15,"
+                                   "16-17,18-19,20-21,22-23,24-25,26-27,28-29,30-31,32-33",
+                                   1000, r) == FileResponse::Whole);
+}
+
+TEST_CASE("Ranges of a file are sent as 206 from the loop", "[server][range]") {
+    std::string body = makeStreamedFile();
+    REQUIRE(!body.empty());
+    ServerGuard server;
+    REQUIRE(server.s != NULL);
+
+    std::string whole = sendRequest(TEST_PORT, "/range");
+    CHECK(whole.find("HTTP/1.1 200 OK") == 0);
+    CHECK(whole.find("accept-ranges: bytes\r\n") != std::string::npos);
+    CHECK(whole.substr(whole.find("\r\n\r\n") + 4) == body);
+
+    std::string one = sendRequest(TEST_PORT, "/range", "Range: bytes=100-109\r\n");
+    CHECK(one.find("HTTP/1.1 206 Partial Content") == 0);
+    CHECK(one.find("content-range: bytes 100-109/65536\r\n") != std::string::npos);
+    CHECK(one.find("content-length: 10\r\n") != std::string::npos);
+    CHECK(one.substr(one.find("\r\n\r\n") + 4) == body.substr(100, 10));
+
+    std::string many = sendRequest(TEST_PORT, "/range", "Range: bytes=0-2, -3\r\n");
+    CHECK(many.find("HTTP/1.1 206 Partial Content") == 0);
+    size_t b = many.find("boundary=");
+    REQUIRE(b != std::string::npos);
+    std::string boundary = many.substr(b + 9, many.find("\r\n", b) - b - 9);
+    std::string expected = "\r\n--" + boundary + "\r\n"
+                           "content-type: text/plain\r\n"
+                           "content-range: bytes 0-2/65536\r\n\r\n" + body.substr(0, 3) +
+                           "\r\n--" + boundary + "\r\n"
+                           "content-type: text/plain\r\n"
+                           "content-range: bytes 65533-65535/65536\r\n\r\n" + body.substr(65533) +
+                           "\r\n--" + boundary + "--\r\n";
+    CHECK(many.substr(many.find("\r\n\r\n") + 4) == expected);
+    std::ostringstream len;
+    len << "content-length: " << expected.size() << "\r\n";
+    CHECK(many.find(len.str()) != std::string::npos);
+
+    std::string none = sendRequest(TEST_PORT, "/range", "Range: bytes=70000-\r\n");
+    CHECK(none.find("HTTP/1.1 416 Range Not Satisfiable") == 0);
+    CHECK(none.find("content-range: bytes */65536\r\n") != std::string::npos);
+
+    // A stale If-Range gets the whole file, a matching one the range
+    std::string stale = sendRequest(TEST_PORT, "/range",
+                                    "Range: bytes=0-9\r\nIf-Range: Sat, 17 Oct 2026 10:00:00 GMT\r\n");
+    CHECK(stale.find("HTTP/1.1 200 OK") == 0);
+    std::string fresh = sendRequest(TEST_PORT, "/range",
+                                    "Range: bytes=0-9\r\nIf-Range: Sun, 18 Oct 2026 10:00:00 GMT\r\n");
+    CHECK(fresh.find("HTTP/1.1 206 Partial Content") == 0);
+    close(streamedFileFd);
+}
+
+static std::string headerValue(const std::string& resp, const std::string& name) {
+    size_t at = resp.find("\r\n" + name + ": ");
+    if (at == std::string::npos) {
+        return "";
+    }
+    at += name.size() + 4;
+    return resp.substr(at, resp.find("\r\n", at) - at);
+}
+
+static void writeFile(const std::string& path, const std::string& data) {
+    FILE* f = std::fopen(path.c_str(), "w");
+    REQUIRE(f != NULL);
+    std::fwrite(data.data(), 1, data.size(), f);
+    std::fclose(f);
+}
+
+TEST_CASE("Static files are served from cached fds and revalidated", "[server][static]") {
+    char dir[] = "/tmp/server_test_static_XXXXXX";
+    REQUIRE(mkdtemp(dir) != NULL);
+    std::string root = dir;
+    writeFile(root + "/a.txt", "hello");
+    writeFile(root + "/b.css", "body {}");
+    writeFile(root + "/c.bin", "c");
+
+    StaticFileHandler files(root, 2);
+    staticFiles = &files;
+    {
+        ServerGuard server;
+        REQUIRE(server.s != NULL);
+
+        std::string ok = sendRequest(TEST_PORT, "/static/a.txt");
+        CHECK(ok.find("HTTP/1.1 200 OK") == 0);
+        CHECK(headerValue(ok, "content-type") == "text/plain; charset=utf-8");
+        CHECK(headerValue(ok, "content-length") == "5");
+        CHECK(ok.substr(ok.find("\r\n\r\n") + 4) == "hello");
+        CHECK(files.cached() == 1);
+        std::string etag = headerValue(ok, "etag");
+        std::string modified = headerValue(ok, "last-modified");
+        REQUIRE(!etag.empty());
+        REQUIRE(!modified.empty());
+
+        std::string same = sendRequest(TEST_PORT, "/static/a.txt", "If-None-Match: W/" + etag + "\r\n");
+        CHECK(same.find("HTTP/1.1 304 Not Modified") == 0);
+        CHECK(headerValue(same, "etag") == etag);
+        CHECK(same.substr(same.find("\r\n\r\n") + 4).empty());
+        CHECK(sendRequest(TEST_PORT, "/static/a.txt", "If-Modified-Since: " + modified + "\r\n")
+                  .find("HTTP/1.1 304 Not Modified") == 0);
+        // If-None-Match wins over If-Modified-Since
+        CHECK(sendRequest(TEST_PORT, "/static/a.txt",
+                          "If-None-Match: \"other\"\r\nIf-Modified-Since: " + modified + "\r\n")
+                  .find("HTTP/1.1 200 OK") == 0);
+
+        std::string part = sendRequest(TEST_PORT, "/static/a.txt", "Range: bytes=1-2\r\n");
+        CHECK(part.find("HTTP/1.1 206 Partial Content") == 0);
+        CHECK(part.substr(part.find("\r\n\r\n") + 4) == "el");
+
+        // A route naming the file gets the same validators, so a resumed
+        // download keeps its Range
+        std::string one = sendRequest(TEST_PORT, "/one", "Range: bytes=1-2\r\nIf-Range: " + etag + "\r\n");
+        CHECK(one.find("HTTP/1.1 206 Partial Content") == 0);
+        CHECK(headerValue(one, "etag") == etag);
+        CHECK(one.substr(one.find("\r\n\r\n") + 4) == "el");
+
+        CHECK(sendRequest(TEST_PORT, "/static/missing").find("HTTP/1.1 404 Not Found") == 0);
+        CHECK(sendRequest(TEST_PORT, "/static/../etc/passwd").find("HTTP/1.1 404 Not Found") == 0);
+        CHECK(sendRequest(TEST_PORT, "/static/%2e%2e/x").find("HTTP/1.1 404 Not Found") == 0);
+        CHECK(sendRequest(TEST_PORT, "/static/").find("HTTP/1.1 404 Not Found") == 0);
+
+        // A change on disk drops the entry before the next request
+        writeFile(root + "/a.txt", "changed!");
+        std::string changed = sendRequest(TEST_PORT, "/static/a.txt");
+        CHECK(changed.substr(changed.find("\r\n\r\n") + 4) == "changed!");
+        CHECK(headerValue(changed, "etag") != etag);
+
+        // The least recently used file is closed past capacity
+        CHECK(sendRequest(TEST_PORT, "/static/b.css").find("text/css") != std::string::npos);
+        CHECK(sendRequest(TEST_PORT, "/static/c.bin").find("application/octet-stream") != std::string::npos);
+        CHECK(files.cached() == 2);
+    }
+    staticFiles = NULL;
+    unlink((root + "/a.txt").c_str());
+    unlink((root + "/b.css").c_str());
+    unlink((root + "/c.bin").c_str());
+    rmdir(dir);
+}
+
+// Requests one static file through a router, as a worker thread would
+struct StaticFetch {
+    Router* router;
+    std::string status;
+};
+
+static void* fetchStatic(void* arg) {
+    StaticFetch* f = static_cast<StaticFetch*>(arg);
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        return NULL;
+    }
+    std::string data = "GET /static/a.txt HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    ssize_t written = write(fds[1], data.data(), data.size());
+    close(fds[1]);
+    std::string err;
+    Request* req = written < 0 ? NULL : Request::requestFromSocket(fds[0], err);
+    close(fds[0]);
+    if (req == NULL) {
+        return NULL;
+    }
+    Response::Writer w(-1);
+    f->router->handle(w, *req);
+    f->status = w.pending() ? "streaming" : "done";
+    delete req;
+    return NULL;
+}
+
+TEST_CASE("Concurrent misses on one static file keep a single entry", "[server][static]") {
+    char dir[] = "/tmp/server_test_static_XXXXXX";
+    REQUIRE(mkdtemp(dir) != NULL);
+    std::string root = dir;
+    writeFile(root + "/a.txt", "hello");
+    {
+        StaticFileHandler files(root);
+        Router router;
+        router.get("/static/*", files);
+        router.freeze();
+
+        const int THREADS = 8;
+        StaticFetch fetches[THREADS];
+        pthread_t tids[THREADS];
+        for (int i = 0; i < THREADS; i++) {
+            fetches[i].router = &router;
+            REQUIRE(pthread_create(&tids[i], NULL, fetchStatic, &fetches[i]) == 0);
+        }
+        for (int i = 0; i < THREADS; i++) {
+            pthread_join(tids[i], NULL);
+            // Every request got the file, whichever load won
+            CHECK(fetches[i].status == "streaming");
+        }
+        CHECK(files.cached() == 1);
+    }
+    unlink((root + "/a.txt").c_str());
+    rmdir(dir);
+}
+
+TEST_CASE("Precompressed codings are negotiated by q-value", "[server][static]") {
+    unsigned all = (1u << FileResponse::Identity) | (1u << FileResponse::Brotli) |
+                   (1u << FileResponse::Gzip);
+    unsigned gzipOnly = (1u << FileResponse::Identity) | (1u << FileResponse::Gzip);
+    CHECK(FileResponse::negotiate("", all) == FileResponse::Identity);
+    CHECK(FileResponse::negotiate("gzip, deflate, br", all) == FileResponse::Brotli);
+    CHECK(FileResponse::negotiate("gzip, deflate, br", gzipOnly) == FileResponse::Gzip);
+    CHECK(FileResponse::negotiate("br;q=0.5, gzip", all) == FileResponse::Gzip);
+    CHECK(FileResponse::negotiate("gzip;q=0.5, identity", all) == FileResponse::Identity);
+    CHECK(FileResponse::negotiate("*", all) == FileResponse::Brotli);
+    CHECK(FileResponse::negotiate("br", 1u << FileResponse::Identity) == FileResponse::Identity);
+    CHECK(FileResponse::negotiate("identity;q=0", gzipOnly) == FileResponse::Identity);
+}
+
+TEST_CASE("Static files are sent as their precompressed sidecars", "[server][static]") {
+    char dir[] = "/tmp/server_test_static_XXXXXX";
+    REQUIRE(mkdtemp(dir) != NULL);
+    std::string root = dir;
+    writeFile(root + "/app.js", "plain");
+    writeFile(root + "/app.js.gz", "gzipped");
+    writeFile(root + "/app.js.br", "brotli");
+    writeFile(root + "/old.txt", "fresh");
+    writeFile(root + "/old.txt.gz", "stale");
+    // The sidecar predates the file
+    struct timeval past[2] = {{1000000000, 0}, {1000000000, 0}};
+    REQUIRE(utimes((root + "/old.txt.gz").c_str(), past) == 0);
+
+    StaticFileHandler files(root);
+    staticFiles = &files;
+    {
+        ServerGuard server;
+        REQUIRE(server.s != NULL);
+
+        std::string plain = sendRequest(TEST_PORT, "/static/app.js");
+        CHECK(plain.substr(plain.find("\r\n\r\n") + 4) == "plain");
+        CHECK(headerValue(plain, "vary") == "accept-encoding");
+        CHECK(headerValue(plain, "content-encoding").empty());
+
+        std::string gz = sendRequest(TEST_PORT, "/static/app.js", "Accept-Encoding: gzip\r\n");
+        CHECK(gz.substr(gz.find("\r\n\r\n") + 4) == "gzipped");
+        CHECK(headerValue(gz, "content-encoding") == "gzip");
+        CHECK(headerValue(gz, "content-type") == "text/javascript; charset=utf-8");
+        CHECK(headerValue(gz, "content-length") == "7");
+        CHECK(headerValue(gz, "vary") == "accept-encoding");
+        CHECK(headerValue(gz, "etag") != headerValue(plain, "etag"));
+
+        std::string br = sendRequest(TEST_PORT, "/static/app.js", "Accept-Encoding: gzip, br\r\n");
+        CHECK(br.substr(br.find("\r\n\r\n") + 4) == "brotli");
+        CHECK(headerValue(br, "content-encoding") == "br");
+
+        // Validators are per variant
+        CHECK(sendRequest(TEST_PORT, "/static/app.js",
+                          "Accept-Encoding: gzip\r\nIf-None-Match: " + headerValue(gz, "etag") + "\r\n")
+                  .find("HTTP/1.1 304 Not Modified") == 0);
+        CHECK(sendRequest(TEST_PORT, "/static/app.js",
+                          "Accept-Encoding: br\r\nIf-None-Match: " + headerValue(gz, "etag") + "\r\n")
+                  .find("HTTP/1.1 200 OK") == 0);
+
+        std::string old = sendRequest(TEST_PORT, "/static/old.txt", "Accept-Encoding: gzip\r\n");
+        CHECK(old.substr(old.find("\r\n\r\n") + 4) == "fresh");
+        CHECK(headerValue(old, "vary").empty());
+
+        // A sidecar added later is picked up
+        writeFile(root + "/old.txt.gz", "rebuilt");
+        old = sendRequest(TEST_PORT, "/static/old.txt", "Accept-Encoding: gzip\r\n");
+        CHECK(old.substr(old.find("\r\n\r\n") + 4) == "rebuilt");
+    }
+    staticFiles = NULL;
+    const char* names[] = {"app.js", "app.js.gz", "app.js.br", "old.txt", "old.txt.gz"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        unlink((root + "/" + names[i]).c_str());
+    }
+    rmdir(dir);
+}